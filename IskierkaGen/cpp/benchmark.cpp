@@ -0,0 +1,464 @@
+// Created by WojFil Games 2024
+// This code is licensed under MIT license (see LICENSE.txt for details)
+
+// benchmark of IskierkaGen on synthetic codebases
+// it builds a codebase of the given shape, then measures loading and generation and prints the results as JSON
+//
+// compile:   g++ -std=c++17 -O2 -pthread benchmark.cpp -o benchmark
+// run:       ./benchmark --variables 2000 --choices 8 --refs 2 --depth 6 --literal 24 --samples 200000
+//
+// all options:
+//   --dir PATH        directory of the synthetic codebase, its *.iski files are overwritten (default 'benchmark_data')
+//   --variables N     number of variables besides the root (default 1000)
+//   --choices N       hash expressions of every variable (default 8)
+//   --refs N          references to variables of the next level in every hash expression (default 2)
+//   --depth N         levels of variables below the root (default 5)
+//   --literal N       characters of string literals in every line (default 24)
+//   --skew X          weight of the hash expression i is 1000 / (i + 1)^X, 0 means uniform (default 1)
+//   --recursive       variables of the last level can refer back to the first level with a small weight
+//   --samples N       samples of every measurement (default 100000)
+//   --threads N       threads of the batch measurement, 0 means all cores (default 0)
+//   --seed N          seed of both the codebase and the generation (default 2024)
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+
+#include "iskierka.h"
+
+
+// every allocation of the program is counted here
+// replaced operators are never inlined, so the compiler does not match calls of malloc() and free() against new and delete
+#if defined(__GNUC__)
+#define BENCHMARK_NOINLINE __attribute__((noinline))
+#else
+#define BENCHMARK_NOINLINE
+#endif
+
+static std::atomic<uint64_t> allocations(0);
+
+BENCHMARK_NOINLINE void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+
+    void* result = std::malloc(size == 0 ? 1 : size);
+    if (result == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return result;
+}
+
+BENCHMARK_NOINLINE void operator delete(void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+BENCHMARK_NOINLINE void operator delete(void* pointer, size_t) noexcept
+{
+    std::free(pointer);
+}
+
+
+namespace benchmark
+{
+
+// the codebase is split into this many files, so the parallel parsing has something to do
+static constexpr int FILES = 8;
+
+// samples generated before every measurement, so the scratch arena is already warm
+static constexpr int WARM_UP_SAMPLES = 1000;
+
+
+struct Options
+{
+    std::string m_dir = "benchmark_data";
+    int64_t m_variables = 1000;
+    int64_t m_choices = 8;
+    int64_t m_refs = 2;
+    int64_t m_depth = 5;
+    int64_t m_literal = 24;
+    double m_skew = 1.0;
+    bool m_recursive = false;
+    int64_t m_samples = 100000;
+    unsigned int m_threads = 0;
+    uint64_t m_seed = 2024;
+};
+
+
+struct Measurement
+{
+    std::string m_mode;
+    std::string m_engine;
+    int64_t m_samples;
+    int64_t m_failed;
+    uint64_t m_bytes;
+    uint64_t m_allocations;
+    double m_seconds;
+};
+
+
+// output target that only counts bytes, so sinks are measured without the cost of a real device
+struct CountingTarget : iskierka::OutputTarget
+{
+public:
+    bool write(const char*, size_t size) override
+    {
+        m_bytes += size;
+        return true;
+    };
+
+    uint64_t m_bytes = 0;
+};
+
+
+static double secondsSince(const std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static bool parseOptions(const int argc, char** argv, Options& options)
+{
+    for (int i = 1; i < argc; i++) {
+        const std::string name = argv[i];
+
+        if (name == "--recursive") {
+            options.m_recursive = true;
+            continue;
+        }
+
+        if (i + 1 == argc) {
+            std::cerr << "option '" << name << "' is not followed by a value" << std::endl;
+            return false;
+        }
+
+        const char* value = argv[++i];
+
+        if (name == "--dir") {
+            options.m_dir = value;
+        }
+        else if (name == "--variables") {
+            options.m_variables = std::max(std::atoll(value), 1LL);
+        }
+        else if (name == "--choices") {
+            options.m_choices = std::max(std::atoll(value), 1LL);
+        }
+        else if (name == "--refs") {
+            options.m_refs = std::max(std::atoll(value), 0LL);
+        }
+        else if (name == "--depth") {
+            options.m_depth = std::max(std::atoll(value), 1LL);
+        }
+        else if (name == "--literal") {
+            options.m_literal = std::max(std::atoll(value), 1LL);
+        }
+        else if (name == "--skew") {
+            options.m_skew = std::max(std::atof(value), 0.0);
+        }
+        else if (name == "--samples") {
+            options.m_samples = std::max(std::atoll(value), 1LL);
+        }
+        else if (name == "--threads") {
+            options.m_threads = static_cast<unsigned int>(std::max(std::atoll(value), 0LL));
+        }
+        else if (name == "--seed") {
+            options.m_seed = std::strtoull(value, nullptr, 10);
+        }
+        else {
+            std::cerr << "unknown option '" << name << "'" << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool makeDirectory(const std::string& path)
+{
+
+#ifdef _WIN32
+    return CreateDirectoryA(path.c_str(), nullptr) != 0 || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+
+}
+
+static std::string variableName(const int64_t level, const int64_t index)
+{
+    return level == 0
+        ? std::string(iskierka::ROOT)
+        : iskierka::concat('v', std::to_string(level), 'n', std::to_string(index));
+}
+
+// random lowercase words of about the given total length
+static void appendWords(std::string& line, const int64_t length, std::mt19937_64& randomness)
+{
+    int64_t written = 0;
+
+    while (written < length) {
+        if (! line.empty()) {
+            line += ' ';
+        }
+
+        const int64_t size = 3 + static_cast<int64_t>(randomness() % 6);
+
+        for (int64_t i = 0; i < size; i++) {
+            line += static_cast<char>('a' + randomness() % 26);
+        }
+
+        written += size + 1;
+    }
+}
+
+// write the synthetic codebase
+// variables are arranged in levels, every hash expression refers to random variables of the next level
+// returns the number of hash expressions or -1 if some file could not be written
+static int64_t writeCodebase(const Options& options, uint64_t& sourceBytes)
+{
+    if (! makeDirectory(options.m_dir)) {
+        return -1;
+    }
+
+    std::mt19937_64 randomness(options.m_seed);
+    const int64_t width = std::max(options.m_variables / options.m_depth, static_cast<int64_t>(1));
+
+    std::vector<std::string> files(FILES);
+    int64_t expressions = 0;
+
+    for (int64_t level = 0; level <= options.m_depth; level++) {
+        const int64_t count = level == 0 ? 1 : width;
+
+        for (int64_t index = 0; index < count; index++) {
+            const bool last = level == options.m_depth;
+            const int64_t choices = options.m_choices + (last && options.m_recursive ? 1 : 0);
+            std::string& file = files[static_cast<size_t>((level * width + index) % FILES)];
+
+            for (int64_t choice = 0; choice < choices; choice++) {
+                const bool backReference = choice == options.m_choices;
+                const int64_t weight = backReference
+                    ? 1
+                    : std::max(static_cast<int64_t>(std::llround(1000.0 / std::pow(choice + 1.0, options.m_skew))),
+                        static_cast<int64_t>(1));
+
+                std::string natural;
+                std::string programming = "p";
+                appendWords(natural, options.m_literal, randomness);
+                appendWords(programming, options.m_literal, randomness);
+
+                const int64_t refs = last ? (backReference ? 1 : 0) : options.m_refs;
+                const int64_t target = backReference ? 1 : level + 1;
+
+                for (int64_t r = 0; r < refs; r++) {
+                    const std::string name = variableName(target,
+                        static_cast<int64_t>(randomness() % static_cast<uint64_t>(width)));
+
+                    natural += iskierka::concat(" _", name);
+                    programming += iskierka::concat(" _", name);
+                }
+
+                file += iskierka::concat('#', variableName(level, index), " weight ", std::to_string(weight), '\n');
+                file += iskierka::concat(natural, '\n', programming, "\n\n");
+                expressions++;
+            }
+        }
+    }
+
+    sourceBytes = 0;
+
+    for (int i = 0; i < FILES; i++) {
+        const std::string path = iskierka::concat(options.m_dir, '/', "synthetic", std::to_string(i), '.', iskierka::EXTENSION);
+        std::FILE* file = std::fopen(path.c_str(), "wb");
+
+        if (file == nullptr) {
+            return -1;
+        }
+
+        const bool written = std::fwrite(files[i].data(), 1, files[i].size(), file) == files[i].size();
+        if (std::fclose(file) != 0 || ! written) {
+            return -1;
+        }
+
+        sourceBytes += files[i].size();
+    }
+
+    return expressions;
+}
+
+// generate samples one by one into strings
+template<typename Engine>
+static Measurement measureNext(const std::shared_ptr<const iskierka::Grammar>& grammar, const Options& options,
+    const std::string& engine)
+{
+    iskierka::BasicGenerator<Engine> generator(grammar, options.m_seed, 0);
+    std::string natural;
+    std::string programming;
+
+    for (int i = 0; i < WARM_UP_SAMPLES; i++) {
+        generator.next(natural, programming);
+    }
+
+    Measurement result = { "next", engine, options.m_samples, 0, 0, 0, 0.0 };
+    const uint64_t allocationsBefore = allocations.load();
+    const auto start = std::chrono::steady_clock::now();
+
+    for (int64_t i = 0; i < options.m_samples; i++) {
+        if (generator.next(natural, programming)) {
+            result.m_bytes += natural.size() + programming.size();
+        }
+        else {
+            result.m_failed++;
+        }
+    }
+
+    result.m_seconds = secondsSince(start);
+    result.m_allocations = allocations.load() - allocationsBefore;
+    return result;
+}
+
+// generate samples directly into a sink
+template<typename Writer>
+static Measurement measureSink(const std::shared_ptr<const iskierka::Grammar>& grammar, const Options& options,
+    const std::string& mode)
+{
+    iskierka::Generator generator(grammar, options.m_seed, 0);
+    CountingTarget target;
+    Writer writer(target);
+
+    for (int i = 0; i < WARM_UP_SAMPLES; i++) {
+        generator.next(writer);
+    }
+
+    writer.flush();
+    target.m_bytes = 0;
+
+    Measurement result = { mode, "xoshiro256", options.m_samples, 0, 0, 0, 0.0 };
+    const uint64_t allocationsBefore = allocations.load();
+    const auto start = std::chrono::steady_clock::now();
+
+    for (int64_t i = 0; i < options.m_samples; i++) {
+        if (! generator.next(writer)) {
+            result.m_failed++;
+        }
+    }
+
+    writer.flush();
+    result.m_seconds = secondsSince(start);
+    result.m_allocations = allocations.load() - allocationsBefore;
+    result.m_bytes = target.m_bytes;
+    return result;
+}
+
+// generate all samples at once on many threads
+static Measurement measureBatch(const Options& options)
+{
+    iskierka::IskierkaGen gen(options.m_dir, iskierka::ISKIERKA_FLAG_NONE, options.m_seed);
+    std::vector<std::string> naturals;
+    std::vector<std::string> programmings;
+
+    Measurement result = { "batch", "xoshiro256", options.m_samples, 0, 0, 0, 0.0 };
+    const uint64_t allocationsBefore = allocations.load();
+    const auto start = std::chrono::steady_clock::now();
+
+    const size_t generated = gen.generateBatch(naturals, programmings, static_cast<size_t>(options.m_samples), options.m_threads);
+
+    result.m_seconds = secondsSince(start);
+    result.m_allocations = allocations.load() - allocationsBefore;
+    result.m_failed = options.m_samples - static_cast<int64_t>(generated);
+
+    for (size_t i = 0; i < naturals.size(); i++) {
+        result.m_bytes += naturals[i].size() + programmings[i].size();
+    }
+
+    return result;
+}
+
+static void printMeasurement(const Measurement& m, const bool last)
+{
+    const double seconds = std::max(m.m_seconds, 1e-9);
+
+    std::printf("    { \"mode\": \"%s\", \"engine\": \"%s\", \"samples\": %lld, \"failed\": %lld, \"seconds\": %.6f, "
+        "\"samplesPerSecond\": %.1f, \"bytesPerSecond\": %.1f, \"allocationsPerSample\": %.4f }%s\n",
+        m.m_mode.c_str(), m.m_engine.c_str(), static_cast<long long>(m.m_samples), static_cast<long long>(m.m_failed),
+        m.m_seconds, static_cast<double>(m.m_samples) / seconds, static_cast<double>(m.m_bytes) / seconds,
+        static_cast<double>(m.m_allocations) / static_cast<double>(m.m_samples), last ? "" : ",");
+}
+
+static int run(const int argc, char** argv)
+{
+    Options options;
+    if (! parseOptions(argc, argv, options)) {
+        return 1;
+    }
+
+    uint64_t sourceBytes = 0;
+    const int64_t expressions = writeCodebase(options, sourceBytes);
+
+    if (expressions < 0) {
+        std::cerr << "the synthetic codebase could not be written into '" << options.m_dir << "'" << std::endl;
+        return 1;
+    }
+
+    // parsing, then the first load with the cache writes it and the second one reads it
+    const std::string cachePath = iskierka::concat(options.m_dir, '/', iskierka::CACHE_FILE);
+    std::remove(cachePath.c_str());
+
+    auto start = std::chrono::steady_clock::now();
+    const uint64_t allocationsBefore = allocations.load();
+    const std::shared_ptr<const iskierka::Grammar> grammar = iskierka::CodebaseLoader(iskierka::ISKIERKA_FLAG_NONE).load(options.m_dir);
+    const double parseSeconds = secondsSince(start);
+    const uint64_t loadAllocations = allocations.load() - allocationsBefore;
+
+    if (grammar == nullptr) {
+        return 1;
+    }
+
+    start = std::chrono::steady_clock::now();
+    iskierka::CodebaseLoader(iskierka::ISKIERKA_FLAG_CACHE).load(options.m_dir);
+    const double cacheWriteSeconds = secondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    iskierka::CodebaseLoader(iskierka::ISKIERKA_FLAG_CACHE).load(options.m_dir);
+    const double cacheReadSeconds = secondsSince(start);
+
+    std::remove(cachePath.c_str());
+
+    std::vector<Measurement> measurements;
+    measurements.push_back(measureNext<iskierka::Xoshiro256>(grammar, options, "xoshiro256"));
+    measurements.push_back(measureNext<std::mt19937_64>(grammar, options, "mt19937_64"));
+    measurements.push_back(measureBatch(options));
+    measurements.push_back(measureSink<iskierka::JsonlWriter>(grammar, options, "jsonl"));
+    measurements.push_back(measureSink<iskierka::TsvWriter>(grammar, options, "tsv"));
+    measurements.push_back(measureSink<iskierka::BinaryWriter>(grammar, options, "binary"));
+
+    std::printf("{\n");
+    std::printf("  \"codebase\": { \"variables\": %lld, \"choices\": %lld, \"refs\": %lld, \"depth\": %lld, \"literal\": %lld, "
+        "\"skew\": %.3f, \"recursive\": %s, \"seed\": %llu, \"hashExpressions\": %lld, \"sourceBytes\": %llu },\n",
+        static_cast<long long>(options.m_variables), static_cast<long long>(options.m_choices),
+        static_cast<long long>(options.m_refs), static_cast<long long>(options.m_depth),
+        static_cast<long long>(options.m_literal), options.m_skew, options.m_recursive ? "true" : "false",
+        static_cast<unsigned long long>(options.m_seed), static_cast<long long>(expressions),
+        static_cast<unsigned long long>(sourceBytes));
+    std::printf("  \"load\": { \"parseSeconds\": %.6f, \"parseAllocations\": %llu, \"cacheWriteSeconds\": %.6f, "
+        "\"cacheReadSeconds\": %.6f },\n",
+        parseSeconds, static_cast<unsigned long long>(loadAllocations), cacheWriteSeconds, cacheReadSeconds);
+    std::printf("  \"generation\": [\n");
+
+    for (size_t i = 0; i < measurements.size(); i++) {
+        printMeasurement(measurements[i], i + 1 == measurements.size());
+    }
+
+    std::printf("  ]\n}\n");
+    return 0;
+}
+
+};
+
+
+int main(int argc, char** argv)
+{
+    return benchmark::run(argc, argv);
+}
@@ -4,19 +4,41 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <memory>
 #include <unordered_map>
 #include <unordered_set>
+#include <deque>
 #include <random>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <queue>
+#include <functional>
+#include <condition_variable>
+#include <future>
+#include <cstdio>
+#include <new>
+#include <type_traits>
+#include <chrono>
+#include <optional>
+#include <limits>
+#include <cmath>
 
 #ifdef _WIN32
     #include <windows.h>
+    #include <io.h>
 #else
     #include <dirent.h>
     #include <cstring>
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
 #endif
 
 
@@ -33,14 +55,89 @@ static constexpr char ROOT[] = "output";
 // prefix of variables in Iskierka code
 static constexpr char PREFIX = '_';
 
-// the default limit of function recursive calls, it prevents stack overflows
+// the default limit of nested variables, it stops fractals that would grow forever
 static constexpr uint64_t DEFAULT_RECURSION_LEVEL_LIMIT = 2048;
 
 // no execution flags
 static constexpr uint32_t ISKIERKA_FLAG_NONE = 0;  
 
 // errors happen as usual, but they do not print messages in the console
-static constexpr uint32_t ISKIERKA_FLAG_SHOW_NO_ERRORS = 1; 
+static constexpr uint32_t ISKIERKA_FLAG_SHOW_NO_ERRORS = 1;
+
+// the compiled grammar is stored in a cache file inside the source directory
+// the next load reads it instead of parsing, as long as no source file has changed
+static constexpr uint32_t ISKIERKA_FLAG_CACHE = 2;
+
+// generators count how often every variable and hash expression is chosen, how many bytes it makes and how long it takes
+// it slows the generation down, so use it only to find expensive rules
+static constexpr uint32_t ISKIERKA_FLAG_STATISTICS = 4;
+
+// big variables made only of string literals are not compiled, their values are read straight from source files
+// source files stay mapped as long as the grammar is used, so only the parts really drawn take memory
+// the cache is not used with this flag
+static constexpr uint32_t ISKIERKA_FLAG_LAZY = 8;
+
+// name of the cache file with the compiled grammar
+static constexpr char CACHE_FILE[] = "codebase.iskic";
+
+// format of cache files, it is increased whenever the layout of the grammar changes
+static constexpr uint32_t CACHE_VERSION = 9;
+
+
+// this section of code classifies characters
+// a table is used instead of std::isspace, which is slow, depends on the locale and cannot take negative chars
+
+static constexpr uint8_t CHAR_SPACE = 1;
+static constexpr uint8_t CHAR_LETTER = 2;
+static constexpr uint8_t CHAR_DIGIT = 4;
+
+struct CharTable
+{
+    uint8_t m_classes[256];
+};
+
+static constexpr CharTable makeCharTable()
+{
+    CharTable table {};
+
+    for (int ch = 0; ch < 256; ch++) {
+        uint8_t classes = 0;
+
+        // the same characters as std::isspace in the "C" locale
+        if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\v' || ch == '\f' || ch == '\r') {
+            classes |= CHAR_SPACE;
+        }
+
+        if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')) {
+            classes |= CHAR_LETTER;
+        }
+
+        if (ch >= '0' && ch <= '9') {
+            classes |= CHAR_DIGIT;
+        }
+
+        table.m_classes[ch] = classes;
+    }
+
+    return table;
+}
+
+static constexpr CharTable CHAR_TABLE = makeCharTable();
+
+static bool hasCharClass(const char ch, const uint8_t classes)
+{
+    return (CHAR_TABLE.m_classes[static_cast<unsigned char>(ch)] & classes) != 0;
+}
+
+static bool isSpace(const char ch)
+{
+    return hasCharClass(ch, CHAR_SPACE);
+}
+
+static bool isDigit(const char ch)
+{
+    return hasCharClass(ch, CHAR_DIGIT);
+}
 
 
 // this section of code provides optimized string concatenation
@@ -95,29 +192,315 @@ static std::string concat(Args const&... args)
 }
 
 
-struct Variable;
+// this section of code provides fast random numbers
+
+// bijective mixing function of 64-bit integers
+static uint64_t mix64(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t splitMix64(uint64_t& state)
+{
+    return mix64(state += 0x9e3779b97f4a7c15ULL);
+}
+
+// seed of the random engine used for sample number 'index' of stream number 'stream'
+// every sample is a pure function of these three values
+static uint64_t sampleSeed(const uint64_t seed, const uint64_t stream, const uint64_t index)
+{
+    return mix64(mix64(mix64(seed) ^ stream) ^ index);
+}
+
+// xoshiro256** by David Blackman and Sebastiano Vigna
+// its state has only 32 bytes, compared with 2.5 KB of std::mt19937_64
+struct Xoshiro256
+{
+public:
+    typedef uint64_t result_type;
+
+    Xoshiro256() = delete;
+    explicit Xoshiro256(const uint64_t value) { seed(value); };
+
+    static constexpr result_type min() { return 0; };
+    static constexpr result_type max() { return UINT64_MAX; };
+
+    void seed(uint64_t value)
+    {
+        for (uint64_t& s : m_state) {
+            s = splitMix64(value);
+        }
+    };
+
+    result_type operator()()
+    {
+        const uint64_t result = rotateLeft(m_state[1] * 5, 7) * 9;
+        const uint64_t t = m_state[1] << 17;
+
+        m_state[2] ^= m_state[0];
+        m_state[3] ^= m_state[1];
+        m_state[1] ^= m_state[2];
+        m_state[0] ^= m_state[3];
+        m_state[2] ^= t;
+        m_state[3] = rotateLeft(m_state[3], 45);
+
+        return result;
+    };
+
+private:
+    static uint64_t rotateLeft(const uint64_t value, const int shift)
+    {
+        return (value << shift) | (value >> (64 - shift));
+    };
+
+    uint64_t m_state[4];
+};
+
+// full 128-bit product of two 64-bit integers
+static void multiply64(const uint64_t a, const uint64_t b, uint64_t& high, uint64_t& low)
+{
+#ifdef __SIZEOF_INT128__
+
+    const unsigned __int128 result = static_cast<unsigned __int128>(a) * b;
+    high = static_cast<uint64_t>(result >> 64);
+    low = static_cast<uint64_t>(result);
+
+#else
+
+    const uint64_t aLow = a & 0xffffffffULL;
+    const uint64_t aHigh = a >> 32;
+    const uint64_t bLow = b & 0xffffffffULL;
+    const uint64_t bHigh = b >> 32;
+
+    const uint64_t ll = aLow * bLow;
+    const uint64_t lh = aLow * bHigh;
+    const uint64_t hl = aHigh * bLow;
+    const uint64_t hh = aHigh * bHigh;
+    const uint64_t middle = (ll >> 32) + (lh & 0xffffffffULL) + (hl & 0xffffffffULL);
+
+    high = hh + (lh >> 32) + (hl >> 32) + (middle >> 32);
+    low = (middle << 32) | (ll & 0xffffffffULL);
+
+#endif
+}
+
+// unbiased random integer from range [0, range)
+// Daniel Lemire's method, it usually needs one multiplication and no division
+// the engine has to return uniformly distributed 64-bit integers
+template<typename Engine>
+static uint64_t randomBelow(Engine& engine, const uint64_t range)
+{
+    static_assert(Engine::min() == 0 && Engine::max() == UINT64_MAX, 
+        "the random engine has to provide 64 random bits");
+
+    uint64_t high;
+    uint64_t low;
+    multiply64(engine(), range, high, low);
+
+    if (low < range) {
+        const uint64_t threshold = (0 - range) % range;
+
+        while (low < threshold) {
+            multiply64(engine(), range, high, low);
+        }
+    }
+
+    return high;
+}
+
+
+// the first block of the parse arena, every next one is twice as big
+static constexpr size_t PARSE_ARENA_FIRST_BLOCK = 4096;
+
+// blocks of the parse arena do not grow beyond this size
+static constexpr size_t PARSE_ARENA_MAX_BLOCK = 1 << 20;
+
+
+// monotonic allocator of parsed structures
+// there are millions of tiny objects in big codebases, so they are not allocated one by one
+// nothing is freed individually, all memory is released at once together with the arena
+class ParseArena
+{
+public:
+    ParseArena() = default;
+    ParseArena(const ParseArena&) = delete;
+    ParseArena& operator=(const ParseArena&) = delete;
+    ParseArena(ParseArena&&) = default;
+    ParseArena& operator=(ParseArena&&) = default;
+
+    // objects are never destroyed, so they cannot own any resources
+    template<typename T, typename... Args>
+    T* create(Args&&... args)
+    {
+        static_assert(std::is_trivially_destructible_v<T>, "objects of the parse arena are never destroyed");
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    };
+
+    // copy of an array, nullptr if the array is empty
+    template<typename T>
+    T* copy(const std::vector<T>& values)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "arrays of the parse arena are copied byte by byte");
+
+        if (values.empty()) {
+            return nullptr;
+        }
+
+        T* result = static_cast<T*>(allocate(values.size() * sizeof(T), alignof(T)));
+        std::memcpy(result, values.data(), values.size() * sizeof(T));
+        return result;
+    };
+
+private:
+    void* allocate(const size_t size, const size_t alignment)
+    {
+        size_t offset = (m_used + alignment - 1) & ~(alignment - 1);
+
+        if (m_blocks.empty() || offset + size > m_capacity) {
+            // memory of operator new is aligned for every fundamental type
+            m_capacity = std::max(m_nextBlock, size);
+            m_nextBlock = std::min(m_nextBlock * 2, PARSE_ARENA_MAX_BLOCK);
+            m_blocks.emplace_back(new char[m_capacity]);
+            offset = 0;
+        }
+
+        m_used = offset + size;
+        return m_blocks.back().get() + offset;
+    };
+
+    std::vector<std::unique_ptr<char[]>> m_blocks;
+    size_t m_capacity = 0;
+    size_t m_used = 0;
+    size_t m_nextBlock = PARSE_ARENA_FIRST_BLOCK;
+};
+
+
+// contiguous array of some parse arena
+template<typename T>
+struct ArenaSpan
+{
+public:
+    ArenaSpan() : m_data(nullptr), m_size(0) { };
+    ArenaSpan(T* data, const size_t size) : m_data(data), m_size(size) { };
+
+    T* begin() const { return m_data; };
+    T* end() const { return m_data + m_size; };
+    size_t size() const { return m_size; };
+    bool empty() const { return m_size == 0; };
+    T& operator[](const size_t index) const { return m_data[index]; };
+
+private:
+    T* m_data;
+    size_t m_size;
+};
+
+
+// id of no variable at all
+static constexpr uint32_t NO_SYMBOL = UINT32_MAX;
+
+
+// hash of variable names, they are short, so it takes whole 8-byte words
+struct NameHasher
+{
+    size_t operator()(const std::string_view name) const
+    {
+        uint64_t hash = name.size();
+        size_t i = 0;
+
+        for (; i + sizeof(uint64_t) <= name.size(); i += sizeof(uint64_t)) {
+            uint64_t word;
+            std::memcpy(&word, name.data() + i, sizeof(uint64_t));
+            hash = mix64(hash ^ word);
+        }
+
+        uint64_t rest = 0;
+        for (size_t shift = 0; i < name.size(); i++, shift += 8) {
+            rest |= static_cast<uint64_t>(static_cast<unsigned char>(name[i])) << shift;
+        }
+
+        return static_cast<size_t>(mix64(hash ^ rest));
+    };
+};
+
+
+// table of variable names interned as dense ids
+// ids are given in the order of first lookups, names are stored only once
+// lookups take string views, so they never allocate
+class SymbolTable
+{
+public:
+    // returns the id of the name, a new one if the name has not been seen yet
+    uint32_t intern(const std::string_view name)
+    {
+        const auto found = m_ids.find(name);
+        if (found != m_ids.end()) {
+            return found->second;
+        }
+
+        const uint32_t id = static_cast<uint32_t>(m_names.size());
+        // the deque never moves its strings, so they can be viewed by keys of the map
+        m_names.emplace_back(name);
+        m_ids.emplace(m_names.back(), id);
+        return id;
+    };
+
+    // NO_SYMBOL if the name has not been seen
+    uint32_t find(const std::string_view name) const
+    {
+        const auto found = m_ids.find(name);
+        return found == m_ids.end() ? NO_SYMBOL : found->second;
+    };
+
+    const std::string& getName(const uint32_t id) const
+    {
+        return m_names[id];
+    };
+
+    size_t size() const
+    {
+        return m_names.size();
+    };
+
+    void clear()
+    {
+        m_ids.clear();
+        m_names.clear();
+    };
+
+private:
+    std::deque<std::string> m_names;
+    std::unordered_map<std::string_view, uint32_t, NameHasher> m_ids;
+};
 
 
 // the smallest unit of an expression
+// units live in the parse arena, so they are never deleted through this base
 struct Unit
 {
 public:
-    virtual Variable* getVariablePtr() const { return nullptr; };
-    virtual std::string getString() const { return std::string(); };
+    // id of the referenced variable, NO_SYMBOL for string literals
+    virtual uint32_t getVariable() const { return NO_SYMBOL; };
+    virtual std::string_view getString() const { return std::string_view(); };
+
+protected:
+    ~Unit() = default;
 };
 
 
 // string literal
+// it is a view of the source file, which stays mapped until the grammar is compiled
 struct ConstUnit : Unit
 {
 public:
     ConstUnit() = delete;
-    ConstUnit(const std::string& val) : m_value(val) { };
+    ConstUnit(const std::string_view val) : m_value(val) { };
 
-    std::string getString() const override { return m_value; }
+    std::string_view getString() const override { return m_value; }
 
 private:
-    const std::string m_value;
+    const std::string_view m_value;
 };
 
 
@@ -126,16 +509,16 @@ struct VariableUnit : Unit
 {
 public:
     VariableUnit() = delete;
-    VariableUnit(Variable& var) : m_variable(var) { };
+    VariableUnit(const uint32_t var) : m_variable(var) { };
 
-    Variable* getVariablePtr() const override { return &m_variable; };
+    uint32_t getVariable() const override { return m_variable; };
 
 private:
-    Variable& m_variable;
+    const uint32_t m_variable;
 };
 
 
-typedef std::vector<std::unique_ptr<Unit>> units_t;
+typedef ArenaSpan<const Unit* const> units_t;
 
 
 struct HashExpression
@@ -143,35 +526,14 @@ struct HashExpression
 public:
     HashExpression() = delete;
 
-    HashExpression(units_t& natural, units_t& programming)
-    {
-        transferUniquePtrs(natural, m_natural);
-        transferUniquePtrs(programming, m_programming);
-        insertUniqueIdents(m_natural);
-        insertUniqueIdents(m_programming);
-    };
-
+    HashExpression(const units_t& natural, const units_t& programming, const ArenaSpan<const uint32_t>& uniqueIdents)
+        : m_natural(natural), m_programming(programming), m_uniqueIdents(uniqueIdents) { };
 
     units_t m_natural;
     units_t m_programming;
-    std::unordered_set<Variable*> m_uniqueIdents;
-
-private:
-    void transferUniquePtrs(units_t& source, units_t& destination)
-    {
-        for (std::unique_ptr<Unit>& s : source) {
-            destination.push_back(std::move(s));
-        }
-    };
-
-    void insertUniqueIdents(const units_t& values) 
-    {
-        for (const std::unique_ptr<Unit>& v : values) {
-            if (v->getVariablePtr() != nullptr) {
-                m_uniqueIdents.emplace(v->getVariablePtr());
-            }
-        }
-    };
+    // ids of unique variables in the order of their first appearance
+    // this order does not depend on ids, so random values are reproducible
+    ArenaSpan<const uint32_t> m_uniqueIdents;
 };
 
 
@@ -179,23 +541,6 @@ private:
 struct Variable
 {
 public:
-    const HashExpression& getRandomHashExpression(std::mt19937_64& randomness)
-    {
-        if (m_units.size() == 1) {
-            return m_units[0];
-        }
-
-        const int64_t rand = (*m_distribution)(randomness);
-
-        for (size_t i = 0; i < m_weights.size(); i++) {
-            if (m_weights[i] > rand) {
-                return m_units[i];
-            }
-        }
-
-        return m_units[m_weights.size() - 1];
-    };
-
     bool weightIntegerOverflow(const int64_t addition) const
     {
         const int64_t result = m_totalWeight + addition;
@@ -204,7 +549,8 @@ public:
 
     // insert new values
     // but only if this variable is not sealed
-    bool insert(units_t& natural, units_t& programming, const int64_t weight)
+    bool insert(const units_t& natural, const units_t& programming, const ArenaSpan<const uint32_t>& uniqueIdents, 
+        const int64_t weight)
     {
         if (m_sealed) {
             return false;
@@ -212,21 +558,19 @@ public:
 
         m_totalWeight += weight;
         m_weights.emplace_back(m_totalWeight);
-        m_units.emplace_back(natural, programming);
+        m_units.emplace_back(natural, programming, uniqueIdents);
 
         return true;
     };
 
     // variable is sealed only once
     // we prepare the probability distribution, so the lists no longer can be extended
+    // afterwards, a hash expression is drawn if and only if its weight is positive
     void seal() 
     {
         m_sealed = true;
-        if (m_units.size() == 1) {
-            return;
-        }
 
-        // if variable only contains hash expressions with weight == 0
+        // if variable only contains hash expressions with weight == 0 (or a single one)
         // prepare a discrete uniform distribution
         if (m_totalWeight == 0) {
             m_totalWeight = static_cast<int64_t>(m_units.size());
@@ -235,8 +579,6 @@ public:
                 m_weights[i] = static_cast<int64_t>(i + 1);
             }
         }
-
-        m_distribution = std::make_unique<std::uniform_int_distribution<int64_t>>(0, m_totalWeight - 1);
     };
 
     bool isEmpty() const 
@@ -244,15 +586,4581 @@ public:
         return m_units.empty();
     };
 
+    const std::vector<HashExpression>& getHashExpressions() const
+    {
+        return m_units;
+    };
+
+    // cumulative weights of hash expressions
+    const std::vector<int64_t>& getWeights() const
+    {
+        return m_weights;
+    };
+
+    int64_t getTotalWeight() const
+    {
+        return m_totalWeight;
+    };
+
 private:
     std::vector<HashExpression> m_units;
     int64_t m_totalWeight = 0;
     std::vector<int64_t> m_weights;
     bool m_sealed = false;
-    std::unique_ptr<std::uniform_int_distribution<int64_t>> m_distribution;
 };
 
 
+// kinds of units in a compiled grammar
+enum UnitKind : uint32_t
+{
+    ConstKind,
+    VariableKind,
+    // a variable folded by the optimization, its value is always empty
+    EmptyKind
+};
+
+
+// compiled unit
+// a string literal is a span of the string pool
+// a reference to some variable keeps its slot in the offset
+// slot is a position of the variable among unique variables of the hash expression
+struct UnitRecord
+{
+    UnitKind m_kind;
+    uint32_t m_offset;
+    uint32_t m_length;
+};
+
+
+// compiled hash expression
+// every pair of members is a half-open range of indices in arrays of the grammar
+struct ExpressionRecord
+{
+    uint32_t m_naturalBegin;
+    uint32_t m_naturalEnd;
+    uint32_t m_programmingBegin;
+    uint32_t m_programmingEnd;
+    uint32_t m_identsBegin;
+    uint32_t m_identsEnd;
+};
+
+
+// how to pick a random hash expression of a compiled variable
+enum SamplingMode : uint32_t
+{
+    // there is only one hash expression
+    SingleSampling,
+    // binary search over cumulative weights, cheaper for a few hash expressions
+    SearchSampling,
+    // Walker's alias table, constant time for any number of hash expressions
+    AliasSampling
+};
+
+
+// compiled variable
+struct VariableRecord
+{
+    uint32_t m_expressionsBegin;
+    uint32_t m_expressionsEnd;
+    int64_t m_totalWeight;
+    SamplingMode m_sampling;
+    // hash expressions are indices of lazy hash expressions instead of m_expressions
+    bool m_lazy = false;
+};
+
+
+// variables with fewer hash expressions are sampled by binary search
+static constexpr uint32_t ALIAS_TABLE_MIN_SIZE = 16;
+
+// variables of string literals with fewer hash expressions are compiled even in the lazy mode
+static constexpr size_t LAZY_MIN_EXPRESSIONS = 64;
+
+// constant values longer than this are not folded, so the string pool cannot grow exponentially
+static constexpr size_t FOLDING_MAX_LENGTH = 4096;
+
+// maximum length of recursive variables, their values can grow without any limit
+static constexpr uint64_t LENGTH_UNBOUNDED = UINT64_MAX;
+
+// expected lengths of recursive variables are refined this many times at most
+static constexpr int ESTIMATE_ITERATIONS = 256;
+
+// height of hash expressions that can never finish, they are recursive without any way out
+static constexpr uint32_t HEIGHT_UNBOUNDED = UINT32_MAX;
+
+// expected lengths are infinite if this many refinements in a row do not get any closer to the solution
+static constexpr int ESTIMATE_DIVERGENCE_STEPS = 8;
+
+// lower bounds of lengths of recursive variables are raised this many times at most
+static constexpr int MINIMUM_ITERATIONS = 64;
+
+// no hash expression of a variable fits into the given bounds
+static constexpr uint32_t NO_EXPRESSION = UINT32_MAX;
+
+// variables with more hash expressions than this draw them a few times among all of them
+// before those within bounds are searched for
+static constexpr uint32_t FITTING_ATTEMPTS = 8;
+
+// exact numbers of derivations stop here, they are either unbounded or too big for 64 bits
+static constexpr uint64_t DERIVATIONS_SATURATED = UINT64_MAX;
+
+
+// sizes of values of a compiled variable
+// they are estimated from string literals alone, a removed space around an empty variable is not taken into account
+struct LengthEstimate
+{
+    // average number of characters, weighted by probabilities of hash expressions
+    // infinity if the recursion of the variable does not converge
+    double m_expectedNatural;
+    double m_expectedProgramming;
+    // the upper bound of the number of characters, LENGTH_UNBOUNDED for recursive variables
+    uint64_t m_maxNatural;
+    uint64_t m_maxProgramming;
+    // average number of hash expressions and units visited by one evaluation
+    double m_expectedExpressions;
+    double m_expectedUnits;
+    // the lower bound of the number of characters, LENGTH_UNBOUNDED if the variable never finishes
+    uint64_t m_minNatural;
+    uint64_t m_minProgramming;
+};
+
+
+// range of lengths of both values, in characters
+struct LengthBounds
+{
+    uint64_t m_minNatural = 0;
+    uint64_t m_maxNatural = LENGTH_UNBOUNDED;
+    uint64_t m_minProgramming = 0;
+    uint64_t m_maxProgramming = LENGTH_UNBOUNDED;
+};
+
+
+// sums and products of lengths stop at LENGTH_UNBOUNDED
+static uint64_t addLengths(const uint64_t a, const uint64_t b)
+{
+    return a > LENGTH_UNBOUNDED - b ? LENGTH_UNBOUNDED : a + b;
+}
+
+static uint64_t multiplyLengths(const uint64_t a, const uint64_t b)
+{
+    uint64_t high;
+    uint64_t low;
+    multiply64(a, b, high, low);
+    return high == 0 ? low : LENGTH_UNBOUNDED;
+}
+
+
+// number of different derivations of a compiled variable
+// a derivation is one choice of hash expressions for the whole tree of nested variables
+// a variable used many times in one hash expression is drawn only once, so it counts once
+// hash expressions of weight 0 are never drawn, so they do not count either
+// different derivations can give equal values, so this is the upper bound of the number of different pairs of values
+struct DerivationCount
+{
+    // exact number, DERIVATIONS_SATURATED if it does not fit into 64 bits
+    uint64_t m_count;
+    // binary logarithm of the number, it is precise enough also beyond 64 bits
+    // infinity if the variable is recursive, minus infinity if it has no derivation at all
+    double m_log2;
+
+    bool isUnbounded() const
+    {
+        return std::isinf(m_log2) && m_log2 > 0;
+    };
+};
+
+
+class MappedFile;
+
+
+// hash expression of a lazy variable, both values are string literals
+// they are views of a source file, which is not read until the hash expression is drawn
+struct LazyExpression
+{
+    std::string_view m_natural;
+    std::string_view m_programming;
+};
+
+
+// flat representation of sealed variables
+// everything lives in a few contiguous arrays and is accessed by indices
+// so the evaluation does no virtual calls and does not chase pointers of separately allocated units
+struct Grammar
+{
+public:
+    // build arrays out of sealed variables
+    // returns false if the codebase is too big to be addressed by 32-bit indices
+    // variables are indexed by ids of the symbol table, they stay the same in the grammar
+    // if lazy, big variables of string literals keep views of source files, which have to outlive the grammar
+    bool compile(const std::vector<Variable>& variables, const SymbolTable& symbols, const uint32_t root, const bool lazy)
+    {
+        m_variables.resize(variables.size());
+        m_names.resize(variables.size());
+
+        for (uint32_t v = 0; v < variables.size(); v++) {
+            const std::vector<HashExpression>& hashExpressions = variables[v].getHashExpressions();
+            const std::vector<int64_t>& weights = variables[v].getWeights();
+            VariableRecord& record = m_variables[v];
+            m_names[v] = symbols.getName(v);
+
+            record.m_totalWeight = variables[v].getTotalWeight();
+
+            if (lazy && isLiteralPool(variables[v])) {
+                record.m_lazy = true;
+                record.m_expressionsBegin = static_cast<uint32_t>(m_lazyExpressions.size());
+
+                for (size_t i = 0; i < hashExpressions.size(); i++) {
+                    m_lazyExpressions.push_back({ getSourceLiteral(hashExpressions[i].m_natural),
+                        getSourceLiteral(hashExpressions[i].m_programming) });
+                    m_lazyWeights.push_back(weights[i]);
+                }
+
+                record.m_expressionsEnd = static_cast<uint32_t>(m_lazyExpressions.size());
+                prepareSampling(record, m_lazyWeights, m_lazyThresholds, m_lazyAliases);
+                continue;
+            }
+
+            record.m_expressionsBegin = static_cast<uint32_t>(m_expressions.size());
+
+            for (size_t i = 0; i < hashExpressions.size(); i++) {
+                const HashExpression& he = hashExpressions[i];
+                ExpressionRecord expr;
+
+                const ArenaSpan<const uint32_t>& slots = he.m_uniqueIdents;
+
+                expr.m_identsBegin = static_cast<uint32_t>(m_idents.size());
+                m_idents.insert(m_idents.end(), slots.begin(), slots.end());
+                expr.m_identsEnd = static_cast<uint32_t>(m_idents.size());
+
+                expr.m_naturalBegin = static_cast<uint32_t>(m_units.size());
+                if (! compileUnits(he.m_natural, slots)) {
+                    return false;
+                }
+                expr.m_naturalEnd = static_cast<uint32_t>(m_units.size());
+
+                expr.m_programmingBegin = static_cast<uint32_t>(m_units.size());
+                if (! compileUnits(he.m_programming, slots)) {
+                    return false;
+                }
+                expr.m_programmingEnd = static_cast<uint32_t>(m_units.size());
+
+                m_expressions.push_back(expr);
+                m_weights.push_back(weights[i]);
+            }
+
+            record.m_expressionsEnd = static_cast<uint32_t>(m_expressions.size());
+            prepareSampling(record, m_weights, m_aliasThresholds, m_aliases);
+        }
+
+        m_root = root;
+
+        if (! fitsIndex(m_units.size()) || ! fitsIndex(m_expressions.size()) || ! fitsIndex(m_idents.size())
+            || ! fitsIndex(m_lazyExpressions.size()))
+        {
+            return false;
+        }
+
+        analyze();
+        return true;
+    };
+
+    // string literal of a compiled unit, it points directly into the string pool
+    std::string_view getLiteral(const UnitRecord& unit) const
+    {
+        return std::string_view(m_pool.data() + unit.m_offset, unit.m_length);
+    };
+
+    // returns an index of a random hash expression of the variable
+    // for a lazy variable, it is an index of a lazy hash expression
+    template<typename Engine>
+    uint32_t getRandomExpression(const uint32_t var, Engine& randomness) const
+    {
+        const VariableRecord& record = m_variables[var];
+
+        return record.m_lazy
+            ? drawExpression(record, m_lazyWeights, m_lazyThresholds, m_lazyAliases, randomness)
+            : drawExpression(record, m_weights, m_aliasThresholds, m_aliases, randomness);
+    };
+
+    // lazy hash expressions are sampled in exactly the same way, so they give the same values as compiled ones
+    template<typename Engine>
+    static uint32_t drawExpression(const VariableRecord& record, const std::vector<int64_t>& weights,
+        const std::vector<uint64_t>& thresholds, const std::vector<uint32_t>& aliases, Engine& randomness)
+    {
+        switch (record.m_sampling) {
+            case SamplingMode::SingleSampling: {
+                return record.m_expressionsBegin;
+            }
+            case SamplingMode::SearchSampling: {
+                const int64_t rand = static_cast<int64_t>(
+                    randomBelow(randomness, static_cast<uint64_t>(record.m_totalWeight)));
+
+                const auto begin = weights.begin() + record.m_expressionsBegin;
+                const auto end = weights.begin() + record.m_expressionsEnd;
+                const auto found = std::upper_bound(begin, end, rand);
+
+                return found == end
+                    ? record.m_expressionsEnd - 1
+                    : static_cast<uint32_t>(found - weights.begin());
+            }
+            default: {
+                // pick a column, then the column itself or its alias
+                const uint32_t size = record.m_expressionsEnd - record.m_expressionsBegin;
+                const uint32_t column = record.m_expressionsBegin + static_cast<uint32_t>(randomBelow(randomness, size));
+
+                return randomBelow(randomness, static_cast<uint64_t>(record.m_totalWeight)) < thresholds[column]
+                    ? column
+                    : aliases[column];
+            }
+        }
+    };
+
+    // fold constant variables into hash expressions that use them and drop variables unreachable from the root
+    // a variable is constant if it has only one hash expression and all variables in it are constant as well
+    // constant variables do not draw random numbers, so every seed gives exactly the same values as before
+    // returns false if the grammar has not been changed, because the result would not fit into 32-bit indices
+    bool optimize()
+    {
+        const uint32_t count = static_cast<uint32_t>(m_variables.size());
+
+        // a variable is known to be constant when all variables of its hash expression are constant
+        // cycles never get there, so they stay as they are
+        std::vector<uint32_t> pending(count, 0);
+        std::vector<std::vector<uint32_t>> dependents(count);
+        std::vector<uint32_t> ready;
+
+        for (uint32_t v = 0; v < count; v++) {
+            const VariableRecord& record = m_variables[v];
+
+            if (record.m_lazy || record.m_expressionsEnd - record.m_expressionsBegin != 1) {
+                pending[v] = UINT32_MAX;
+                continue;
+            }
+
+            const ExpressionRecord& expr = m_expressions[record.m_expressionsBegin];
+            pending[v] = expr.m_identsEnd - expr.m_identsBegin;
+
+            for (uint32_t i = expr.m_identsBegin; i < expr.m_identsEnd; i++) {
+                dependents[m_idents[i]].push_back(v);
+            }
+
+            if (pending[v] == 0) {
+                ready.push_back(v);
+            }
+        }
+
+        std::vector<std::string> naturals(count);
+        std::vector<std::string> programmings(count);
+        // constant variables that can be replaced by their values
+        std::vector<bool> folded(count, false);
+
+        while (! ready.empty()) {
+            const uint32_t v = ready.back();
+            ready.pop_back();
+
+            const ExpressionRecord& expr = m_expressions[m_variables[v].m_expressionsBegin];
+
+            if (! evaluateConstant(expr.m_naturalBegin, expr.m_naturalEnd, expr.m_identsBegin, naturals, naturals[v])
+                || ! evaluateConstant(expr.m_programmingBegin, expr.m_programmingEnd, expr.m_identsBegin, programmings, programmings[v]))
+            {
+                continue;
+            }
+
+            // a literal loses its leading space after an empty variable, a variable does not
+            folded[v] = (naturals[v].empty() || ! isSpace(naturals[v][0]))
+                && (programmings[v].empty() || ! isSpace(programmings[v][0]));
+
+            for (const uint32_t u : dependents[v]) {
+                pending[u]--;
+                if (pending[u] == 0) {
+                    ready.push_back(u);
+                }
+            }
+        }
+
+        // variables are kept only if some hash expression still refers to them
+        std::vector<uint32_t> indices(count, UINT32_MAX);
+        std::vector<uint32_t> reachable = { m_root };
+        indices[m_root] = 0;
+
+        for (size_t r = 0; r < reachable.size(); r++) {
+            const VariableRecord& record = m_variables[reachable[r]];
+
+            for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd && ! record.m_lazy; e++) {
+                const ExpressionRecord& expr = m_expressions[e];
+
+                for (uint32_t i = expr.m_identsBegin; i < expr.m_identsEnd; i++) {
+                    const uint32_t var = m_idents[i];
+
+                    if (! folded[var] && indices[var] == UINT32_MAX) {
+                        indices[var] = 0;
+                        reachable.push_back(var);
+                    }
+                }
+            }
+        }
+
+        // new indices follow the original order of variables
+        uint32_t next = 0;
+        for (uint32_t v = 0; v < count; v++) {
+            if (indices[v] != UINT32_MAX) {
+                indices[v] = next++;
+            }
+        }
+
+        Grammar result;
+        result.m_variables.resize(next);
+        result.m_names.resize(next);
+        std::vector<uint32_t> slots;
+
+        for (uint32_t v = 0; v < count; v++) {
+            if (indices[v] == UINT32_MAX) {
+                continue;
+            }
+
+            const VariableRecord& record = m_variables[v];
+            VariableRecord& newRecord = result.m_variables[indices[v]];
+            newRecord = record;
+            result.m_names[indices[v]] = m_names[v];
+
+            if (record.m_lazy) {
+                newRecord.m_expressionsBegin = static_cast<uint32_t>(result.m_lazyExpressions.size());
+
+                for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd; e++) {
+                    result.m_lazyExpressions.push_back(m_lazyExpressions[e]);
+                    result.m_lazyWeights.push_back(m_lazyWeights[e]);
+                    result.m_lazyThresholds.push_back(m_lazyThresholds[e]);
+                    result.m_lazyAliases.push_back(record.m_sampling == SamplingMode::AliasSampling
+                        ? m_lazyAliases[e] - record.m_expressionsBegin + newRecord.m_expressionsBegin
+                        : 0);
+                }
+
+                newRecord.m_expressionsEnd = static_cast<uint32_t>(result.m_lazyExpressions.size());
+                continue;
+            }
+
+            newRecord.m_expressionsBegin = static_cast<uint32_t>(result.m_expressions.size());
+
+            for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd; e++) {
+                const ExpressionRecord& expr = m_expressions[e];
+                ExpressionRecord newExpr;
+
+                // the order of remaining variables does not change, so random numbers are drawn in the same order
+                slots.clear();
+                newExpr.m_identsBegin = static_cast<uint32_t>(result.m_idents.size());
+
+                for (uint32_t i = expr.m_identsBegin; i < expr.m_identsEnd; i++) {
+                    if (folded[m_idents[i]]) {
+                        slots.push_back(UINT32_MAX);
+                    }
+                    else {
+                        slots.push_back(static_cast<uint32_t>(result.m_idents.size()) - newExpr.m_identsBegin);
+                        result.m_idents.push_back(indices[m_idents[i]]);
+                    }
+                }
+
+                newExpr.m_identsEnd = static_cast<uint32_t>(result.m_idents.size());
+
+                newExpr.m_naturalBegin = static_cast<uint32_t>(result.m_units.size());
+                if (! rewriteUnits(expr.m_naturalBegin, expr.m_naturalEnd, expr.m_identsBegin, slots, naturals, result)) {
+                    return false;
+                }
+                newExpr.m_naturalEnd = static_cast<uint32_t>(result.m_units.size());
+
+                newExpr.m_programmingBegin = static_cast<uint32_t>(result.m_units.size());
+                if (! rewriteUnits(expr.m_programmingBegin, expr.m_programmingEnd, expr.m_identsBegin, slots, programmings, result)) {
+                    return false;
+                }
+                newExpr.m_programmingEnd = static_cast<uint32_t>(result.m_units.size());
+
+                result.m_expressions.push_back(newExpr);
+                result.m_weights.push_back(m_weights[e]);
+                result.m_aliasThresholds.push_back(m_aliasThresholds[e]);
+                result.m_aliases.push_back(record.m_sampling == SamplingMode::AliasSampling
+                    ? m_aliases[e] - record.m_expressionsBegin + newRecord.m_expressionsBegin
+                    : 0);
+            }
+
+            newRecord.m_expressionsEnd = static_cast<uint32_t>(result.m_expressions.size());
+        }
+
+        if (! fitsIndex(result.m_units.size()) || ! fitsIndex(result.m_idents.size())) {
+            return false;
+        }
+
+        result.m_root = indices[m_root];
+        result.m_sources = std::move(m_sources);
+        *this = std::move(result);
+        analyze();
+        return true;
+    };
+
+    // how many different derivations the variable has
+    const DerivationCount& getDerivations(const uint32_t var) const
+    {
+        return m_derivations[var];
+    };
+
+    // returns the hash expression of the derivation number 'rank' of the variable
+    // then rank is the number of the derivation among derivations of this hash expression
+    // the number of derivations of the variable has to be exact and greater than rank
+    uint32_t getExpressionAt(const uint32_t var, uint64_t& rank) const
+    {
+        const VariableRecord& record = m_variables[var];
+
+        // every lazy hash expression is one derivation
+        if (record.m_lazy) {
+            const uint32_t expr = record.m_expressionsBegin + static_cast<uint32_t>(rank);
+            rank = 0;
+            return expr;
+        }
+        const auto begin = m_derivationOffsets.begin() + record.m_expressionsBegin;
+        const auto end = m_derivationOffsets.begin() + record.m_expressionsEnd;
+        const uint32_t expr = static_cast<uint32_t>(std::upper_bound(begin, end, rank) - m_derivationOffsets.begin());
+
+        if (expr != record.m_expressionsBegin) {
+            rank -= m_derivationOffsets[expr - 1];
+        }
+
+        return expr;
+    };
+
+    // the smallest number of nested variables (including itself) this variable needs to finish
+    uint32_t getMinimumDepth(const uint32_t var) const
+    {
+        if (m_variables[var].m_lazy) {
+            return 1;
+        }
+
+        return m_heights[m_heightOrder[m_variables[var].m_expressionsBegin]];
+    };
+
+    // returns an index of a random hash expression of the variable that finishes within the given number of nested variables
+    // if all of them do, this is exactly getRandomExpression()
+    // otherwise the draw is restricted to hash expressions that are low enough, with the same proportions of weights
+    template<typename Engine>
+    uint32_t getBoundedExpression(const uint32_t var, const uint32_t maxHeight, Engine& randomness) const
+    {
+        const VariableRecord& record = m_variables[var];
+
+        // lazy hash expressions have no variables, so they all finish at once
+        if (record.m_lazy || m_heights[m_heightOrder[record.m_expressionsEnd - 1]] <= maxHeight) {
+            return getRandomExpression(var, randomness);
+        }
+
+        const auto begin = m_heightOrder.begin() + record.m_expressionsBegin;
+        const auto end = m_heightOrder.begin() + record.m_expressionsEnd;
+        const auto low = std::upper_bound(begin, end, maxHeight, 
+            [this](const uint32_t height, const uint32_t e) { return height < m_heights[e]; });
+
+        const uint32_t size = static_cast<uint32_t>(low - begin);
+        const int64_t total = size == 0 ? 0 : m_heightWeights[record.m_expressionsBegin + size - 1];
+
+        // only hash expressions of weight 0 are low enough, so they are all equally likely
+        if (total == 0) {
+            return m_heightOrder[record.m_expressionsBegin + static_cast<uint32_t>(randomBelow(randomness, size))];
+        }
+
+        const int64_t rand = static_cast<int64_t>(randomBelow(randomness, static_cast<uint64_t>(total)));
+        const auto weightsBegin = m_heightWeights.begin() + record.m_expressionsBegin;
+        const auto found = std::upper_bound(weightsBegin, weightsBegin + size, rand);
+
+        return m_heightOrder[record.m_expressionsBegin + static_cast<uint32_t>(found - weightsBegin)];
+    };
+
+    // bounds of lengths of values of a hash expression of the variable
+    LengthBounds getExpressionBounds(const uint32_t var, const uint32_t expr) const
+    {
+        if (! m_variables[var].m_lazy) {
+            return m_expressionBounds[expr];
+        }
+
+        const LazyExpression& lazy = m_lazyExpressions[expr];
+        return { lazy.m_natural.size(), lazy.m_natural.size(), lazy.m_programming.size(), lazy.m_programming.size() };
+    };
+
+    // returns an index of a random hash expression of the variable that can give values with lengths within the window
+    // and that finishes within the given number of nested variables, NO_EXPRESSION if there is none
+    // if all hash expressions fit into the window, this is exactly getBoundedExpression()
+    // otherwise the draw is restricted to those that fit, with the same proportions of weights
+    // the variable has to have some hash expression within the given height, see getMinimumDepth()
+    template<typename Engine>
+    uint32_t getFittingExpression(const uint32_t var, const LengthBounds& window, const uint32_t maxHeight, Engine& randomness) const
+    {
+        const VariableRecord& record = m_variables[var];
+
+        if (containsBounds(window, m_choiceBounds[var])) {
+            return getBoundedExpression(var, maxHeight, randomness);
+        }
+
+        const std::vector<int64_t>& weights = record.m_lazy ? m_lazyWeights : m_weights;
+
+        auto fits = [&](const uint32_t e) {
+            return overlapsBounds(window, getExpressionBounds(var, e)) && (record.m_lazy || m_heights[e] <= maxHeight);
+        };
+
+        auto weight = [&](const uint32_t e) {
+            return weights[e] - (e == record.m_expressionsBegin ? 0 : weights[e - 1]);
+        };
+
+        // draws that do not fit are simply repeated, it keeps the proportions and it is cheap for variables with many hash expressions
+        if (record.m_expressionsEnd - record.m_expressionsBegin > FITTING_ATTEMPTS) {
+            for (uint32_t attempt = 0; attempt < FITTING_ATTEMPTS; attempt++) {
+                const uint32_t e = getBoundedExpression(var, maxHeight, randomness);
+
+                if (fits(e)) {
+                    return e;
+                }
+            }
+        }
+
+        int64_t total = 0;
+        uint32_t size = 0;
+
+        for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd; e++) {
+            if (fits(e)) {
+                total += weight(e);
+                size++;
+            }
+        }
+
+        if (size == 0) {
+            return NO_EXPRESSION;
+        }
+
+        // only hash expressions of weight 0 fit, so they are all equally likely
+        const bool uniform = total == 0;
+        uint64_t rand = randomBelow(randomness, uniform ? size : static_cast<uint64_t>(total));
+        uint32_t last = record.m_expressionsBegin;
+
+        for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd; e++) {
+            if (! fits(e)) {
+                continue;
+            }
+
+            const uint64_t w = uniform ? 1 : static_cast<uint64_t>(weight(e));
+
+            if (rand < w) {
+                return e;
+            }
+
+            rand -= w;
+            last = e;
+        }
+
+        return last;
+    };
+
+    // check that every index points inside its array
+    // a grammar read from a damaged cache file is rejected here instead of crashing the evaluation
+    bool isConsistent() const
+    {
+        if (m_weights.size() != m_expressions.size()
+            || m_aliasThresholds.size() != m_expressions.size()
+            || m_aliases.size() != m_expressions.size()
+            || m_lengths.size() != m_variables.size()
+            || m_names.size() != m_variables.size()
+            || m_heights.size() != m_expressions.size()
+            || m_heightOrder.size() != m_expressions.size()
+            || m_heightWeights.size() != m_expressions.size()
+            || m_derivations.size() != m_variables.size()
+            || m_derivationOffsets.size() != m_expressions.size()
+            || m_expressionBounds.size() != m_expressions.size()
+            || m_choiceBounds.size() != m_variables.size()
+            || m_lazyWeights.size() != m_lazyExpressions.size()
+            || m_lazyThresholds.size() != m_lazyExpressions.size()
+            || m_lazyAliases.size() != m_lazyExpressions.size()
+            || m_root >= m_variables.size())
+        {
+            return false;
+        }
+
+        for (const uint32_t ident : m_idents) {
+            if (ident >= m_variables.size()) {
+                return false;
+            }
+        }
+
+        for (const ExpressionRecord& expr : m_expressions) {
+            if (expr.m_identsBegin > expr.m_identsEnd || expr.m_identsEnd > m_idents.size()
+                || ! unitsConsistent(expr.m_naturalBegin, expr.m_naturalEnd, expr.m_identsEnd - expr.m_identsBegin)
+                || ! unitsConsistent(expr.m_programmingBegin, expr.m_programmingEnd, expr.m_identsEnd - expr.m_identsBegin))
+            {
+                return false;
+            }
+        }
+
+        for (const VariableRecord& record : m_variables) {
+            if (record.m_lazy) {
+                if (! lazyConsistent(record)) {
+                    return false;
+                }
+
+                continue;
+            }
+
+            if (record.m_expressionsBegin >= record.m_expressionsEnd
+                || record.m_expressionsEnd > m_expressions.size()
+                || record.m_sampling > SamplingMode::AliasSampling)
+            {
+                return false;
+            }
+
+            for (uint32_t i = record.m_expressionsBegin; i < record.m_expressionsEnd; i++) {
+                if (m_heightOrder[i] < record.m_expressionsBegin || m_heightOrder[i] >= record.m_expressionsEnd) {
+                    return false;
+                }
+            }
+
+            if (record.m_sampling == SamplingMode::AliasSampling) {
+                for (uint32_t i = record.m_expressionsBegin; i < record.m_expressionsEnd; i++) {
+                    if (m_aliases[i] < record.m_expressionsBegin || m_aliases[i] >= record.m_expressionsEnd) {
+                        return false;
+                    }
+                }
+            }
+        }
+
+        return true;
+    };
+
+    // all string literals stored one after another
+    std::string m_pool;
+    std::vector<UnitRecord> m_units;
+    std::vector<ExpressionRecord> m_expressions;
+    // cumulative weights of hash expressions of every variable, parallel to m_expressions
+    std::vector<int64_t> m_weights;
+    // alias tables of variables sampled by them, parallel to m_expressions
+    std::vector<uint64_t> m_aliasThresholds;
+    std::vector<uint32_t> m_aliases;
+    // unique variables referenced by hash expressions
+    std::vector<uint32_t> m_idents;
+    std::vector<VariableRecord> m_variables;
+    // these two are parallel to m_variables
+    std::vector<LengthEstimate> m_lengths;
+    std::vector<std::string> m_names;
+    // the smallest number of nested variables (including itself) a hash expression needs to finish
+    // parallel to m_expressions, HEIGHT_UNBOUNDED if it never finishes
+    std::vector<uint32_t> m_heights;
+    // hash expressions of every variable sorted by their heights and cumulative weights in this order
+    // both are parallel to m_expressions
+    std::vector<uint32_t> m_heightOrder;
+    std::vector<int64_t> m_heightWeights;
+    // parallel to m_variables
+    std::vector<DerivationCount> m_derivations;
+    // cumulative numbers of derivations of hash expressions of every variable, parallel to m_expressions
+    // they are exact only for variables whose number of derivations is exact
+    std::vector<uint64_t> m_derivationOffsets;
+    // bounds of lengths of values of every hash expression, parallel to m_expressions
+    std::vector<LengthBounds> m_expressionBounds;
+    // every hash expression of the variable fits into a window that contains these bounds
+    // the minimum is the smallest maximum of its hash expressions and the maximum is the biggest minimum
+    // parallel to m_variables
+    std::vector<LengthBounds> m_choiceBounds;
+    // hash expressions of lazy variables with their cumulative weights and alias tables, all parallel to each other
+    std::vector<LazyExpression> m_lazyExpressions;
+    std::vector<int64_t> m_lazyWeights;
+    std::vector<uint64_t> m_lazyThresholds;
+    std::vector<uint32_t> m_lazyAliases;
+    // source files viewed by lazy hash expressions
+    std::vector<std::shared_ptr<const MappedFile>> m_sources;
+    uint32_t m_root = 0;
+
+private:
+    // compute everything derived from the arrays of hash expressions
+    void analyze()
+    {
+        estimateLengths();
+        prepareHeights();
+        prepareBounds();
+        countDerivations();
+    };
+
+    // bounds of lengths of every hash expression and variable
+    // the maximum comes from estimates, the minimum is found separately for each field
+    void prepareBounds()
+    {
+        const uint32_t count = static_cast<uint32_t>(m_variables.size());
+
+        m_expressionBounds.resize(m_expressions.size());
+        m_choiceBounds.resize(count);
+
+        std::vector<uint32_t> order;
+        std::vector<uint32_t> recursive;
+        orderVariables(order, recursive);
+
+        const std::vector<uint64_t> naturals = findMinimumLengths(order, recursive, true);
+        const std::vector<uint64_t> programmings = findMinimumLengths(order, recursive, false);
+
+        for (uint32_t v = 0; v < count; v++) {
+            const VariableRecord& record = m_variables[v];
+            LengthBounds& choice = m_choiceBounds[v];
+            choice = { LENGTH_UNBOUNDED, 0, LENGTH_UNBOUNDED, 0 };
+
+            m_lengths[v].m_minNatural = naturals[v];
+            m_lengths[v].m_minProgramming = programmings[v];
+
+            for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd; e++) {
+                if (! record.m_lazy) {
+                    const ExpressionRecord& expr = m_expressions[e];
+                    double expected;
+
+                    estimateUnits(expr.m_naturalBegin, expr.m_naturalEnd, expr.m_identsBegin, true, 
+                        expected, m_expressionBounds[e].m_maxNatural);
+                    estimateUnits(expr.m_programmingBegin, expr.m_programmingEnd, expr.m_identsBegin, false, 
+                        expected, m_expressionBounds[e].m_maxProgramming);
+                }
+
+                if (! isDrawn(record, record.m_lazy ? m_lazyWeights : m_weights, e)) {
+                    continue;
+                }
+
+                const LengthBounds bounds = getExpressionBounds(v, e);
+                choice.m_minNatural = std::min(choice.m_minNatural, bounds.m_maxNatural);
+                choice.m_maxNatural = std::max(choice.m_maxNatural, bounds.m_minNatural);
+                choice.m_minProgramming = std::min(choice.m_minProgramming, bounds.m_maxProgramming);
+                choice.m_maxProgramming = std::max(choice.m_maxProgramming, bounds.m_minProgramming);
+            }
+        }
+    };
+
+    // lower bounds of lengths of every variable in one field
+    // variables that do not depend on recursion get the exact bound at once, in their order
+    // recursive variables start from 0 and their bounds are raised again and again, every step is still a lower bound
+    // bounds of compiled hash expressions are stored as well, LENGTH_UNBOUNDED for those that never finish
+    std::vector<uint64_t> findMinimumLengths(const std::vector<uint32_t>& order, const std::vector<uint32_t>& recursive, 
+        const bool isNatural)
+    {
+        std::vector<uint64_t> result(m_variables.size(), 0);
+
+        for (const uint32_t v : order) {
+            result[v] = minimumVariable(v, isNatural, result);
+        }
+
+        for (const uint32_t v : recursive) {
+            if (getMinimumDepth(v) == HEIGHT_UNBOUNDED) {
+                result[v] = LENGTH_UNBOUNDED;
+            }
+        }
+
+        bool converged = recursive.empty();
+
+        for (int iteration = 0; iteration < MINIMUM_ITERATIONS && ! converged; iteration++) {
+            converged = true;
+
+            for (const uint32_t v : recursive) {
+                if (result[v] == LENGTH_UNBOUNDED) {
+                    continue;
+                }
+
+                const uint64_t next = minimumVariable(v, isNatural, result);
+
+                if (next != result[v]) {
+                    result[v] = next;
+                    converged = false;
+                }
+            }
+        }
+
+        for (uint32_t e = 0; e < m_expressions.size(); e++) {
+            const uint64_t value = minimumExpression(e, isNatural, result);
+
+            if (isNatural) {
+                m_expressionBounds[e].m_minNatural = value;
+            }
+            else {
+                m_expressionBounds[e].m_minProgramming = value;
+            }
+        }
+
+        return result;
+    };
+
+    uint64_t minimumVariable(const uint32_t var, const bool isNatural, const std::vector<uint64_t>& minimums) const
+    {
+        const VariableRecord& record = m_variables[var];
+        uint64_t result = LENGTH_UNBOUNDED;
+
+        for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd; e++) {
+            if (record.m_lazy) {
+                const LazyExpression& expr = m_lazyExpressions[e];
+                result = std::min(result, static_cast<uint64_t>(isNatural ? expr.m_natural.size() : expr.m_programming.size()));
+            }
+            else {
+                result = std::min(result, minimumExpression(e, isNatural, minimums));
+            }
+        }
+
+        return result;
+    };
+
+    // an empty variable can remove one space next to it, so every variable that can be empty takes away one character
+    uint64_t minimumExpression(const uint32_t e, const bool isNatural, const std::vector<uint64_t>& minimums) const
+    {
+        if (m_heights[e] == HEIGHT_UNBOUNDED) {
+            return LENGTH_UNBOUNDED;
+        }
+
+        const ExpressionRecord& expr = m_expressions[e];
+        const uint32_t begin = isNatural ? expr.m_naturalBegin : expr.m_programmingBegin;
+        const uint32_t end = isNatural ? expr.m_naturalEnd : expr.m_programmingEnd;
+        uint64_t length = 0;
+        uint64_t removed = 0;
+
+        for (uint32_t i = begin; i < end; i++) {
+            const UnitRecord& unit = m_units[i];
+
+            if (unit.m_kind == UnitKind::ConstKind) {
+                length = addLengths(length, unit.m_length);
+            }
+            else if (unit.m_kind == UnitKind::VariableKind) {
+                const uint64_t child = minimums[m_idents[expr.m_identsBegin + unit.m_offset]];
+                length = addLengths(length, child);
+
+                if (child == 0) {
+                    removed++;
+                }
+            }
+            else {
+                removed++;
+            }
+        }
+
+        return length > removed ? length - removed : 0;
+    };
+
+    // heights are found in increasing order, like distances of Dijkstra's algorithm
+    // a hash expression gets its height when heights of all its variables are known
+    // and a variable gets the smallest height of its hash expressions
+    void prepareHeights()
+    {
+        const uint32_t count = static_cast<uint32_t>(m_variables.size());
+        const uint32_t expressions = static_cast<uint32_t>(m_expressions.size());
+
+        std::vector<uint32_t> owners(expressions);
+        std::vector<uint32_t> pending(expressions);
+        std::vector<std::vector<uint32_t>> users(count);
+        std::vector<uint32_t> depths(count, HEIGHT_UNBOUNDED);
+
+        // pairs of a height and a variable, the lowest on the top
+        typedef std::pair<uint32_t, uint32_t> candidate_t;
+        std::priority_queue<candidate_t, std::vector<candidate_t>, std::greater<candidate_t>> queue;
+
+        m_heights.assign(expressions, HEIGHT_UNBOUNDED);
+
+        for (uint32_t v = 0; v < count; v++) {
+            const VariableRecord& record = m_variables[v];
+
+            if (record.m_lazy) {
+                queue.push({ 1, v });
+                continue;
+            }
+
+            for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd; e++) {
+                const ExpressionRecord& expr = m_expressions[e];
+                owners[e] = v;
+                pending[e] = expr.m_identsEnd - expr.m_identsBegin;
+
+                for (uint32_t i = expr.m_identsBegin; i < expr.m_identsEnd; i++) {
+                    users[m_idents[i]].push_back(e);
+                }
+
+                if (pending[e] == 0) {
+                    m_heights[e] = 1;
+                    queue.push({ 1, v });
+                }
+            }
+        }
+
+        while (! queue.empty()) {
+            const candidate_t top = queue.top();
+            queue.pop();
+
+            if (depths[top.second] != HEIGHT_UNBOUNDED) {
+                continue;
+            }
+
+            depths[top.second] = top.first;
+
+            for (const uint32_t e : users[top.second]) {
+                pending[e]--;
+
+                if (pending[e] == 0) {
+                    // variables are known in increasing order, so this one is the highest
+                    m_heights[e] = top.first + 1;
+                    queue.push({ m_heights[e], owners[e] });
+                }
+            }
+        }
+
+        m_heightOrder.resize(expressions);
+        m_heightWeights.resize(expressions);
+
+        for (uint32_t v = 0; v < count; v++) {
+            const VariableRecord& record = m_variables[v];
+
+            if (record.m_lazy) {
+                continue;
+            }
+
+            const auto begin = m_heightOrder.begin() + record.m_expressionsBegin;
+            const auto end = m_heightOrder.begin() + record.m_expressionsEnd;
+
+            for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd; e++) {
+                m_heightOrder[e] = e;
+            }
+
+            std::stable_sort(begin, end, [this](const uint32_t a, const uint32_t b) { return m_heights[a] < m_heights[b]; });
+
+            int64_t total = 0;
+
+            for (uint32_t i = record.m_expressionsBegin; i < record.m_expressionsEnd; i++) {
+                const uint32_t e = m_heightOrder[i];
+                total += m_weights[e] - (e == record.m_expressionsBegin ? 0 : m_weights[e - 1]);
+                m_heightWeights[i] = total;
+            }
+        }
+    };
+
+    // derivations are counted for strongly connected components of variables, children first
+    // only live variables take part, these are the ones with at least one derivation
+    // then every cycle among them can be repeated any number of times, so it is unbounded
+    // and so is everything that refers to it
+    void countDerivations()
+    {
+        const uint32_t count = static_cast<uint32_t>(m_variables.size());
+        const uint32_t expressions = static_cast<uint32_t>(m_expressions.size());
+
+        // a variable is live when some hash expression of a positive weight has only live variables
+        std::vector<uint32_t> owners(expressions);
+        std::vector<uint32_t> pending(expressions);
+        std::vector<std::vector<uint32_t>> users(count);
+        std::vector<bool> live(count, false);
+        std::vector<uint32_t> ready;
+
+        for (uint32_t v = 0; v < count; v++) {
+            const VariableRecord& record = m_variables[v];
+
+            // all lazy hash expressions count and they have no variables
+            if (record.m_lazy) {
+                ready.push_back(v);
+                continue;
+            }
+
+            for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd; e++) {
+                if (! isDrawn(record, m_weights, e)) {
+                    pending[e] = UINT32_MAX;
+                    continue;
+                }
+
+                const ExpressionRecord& expr = m_expressions[e];
+                owners[e] = v;
+                pending[e] = expr.m_identsEnd - expr.m_identsBegin;
+
+                for (uint32_t i = expr.m_identsBegin; i < expr.m_identsEnd; i++) {
+                    users[m_idents[i]].push_back(e);
+                }
+
+                if (pending[e] == 0) {
+                    ready.push_back(v);
+                }
+            }
+        }
+
+        while (! ready.empty()) {
+            const uint32_t v = ready.back();
+            ready.pop_back();
+
+            if (live[v]) {
+                continue;
+            }
+
+            live[v] = true;
+
+            for (const uint32_t e : users[v]) {
+                pending[e]--;
+                if (pending[e] == 0) {
+                    ready.push_back(owners[e]);
+                }
+            }
+        }
+
+        // edges lead from live variables to variables of their hash expressions that count
+        std::vector<std::vector<uint32_t>> edges(count);
+
+        for (uint32_t v = 0; v < count; v++) {
+            const VariableRecord& record = m_variables[v];
+
+            for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd && live[v] && ! record.m_lazy; e++) {
+                if (pending[e] == 0) {
+                    const ExpressionRecord& expr = m_expressions[e];
+                    edges[v].insert(edges[v].end(), m_idents.begin() + expr.m_identsBegin, m_idents.begin() + expr.m_identsEnd);
+                }
+            }
+        }
+
+        m_derivations.assign(count, { 0, -std::numeric_limits<double>::infinity() });
+        m_derivationOffsets.assign(expressions, 0);
+
+        // Tarjan's algorithm with an explicit stack, components are completed children first
+        struct Visit
+        {
+            uint32_t m_variable;
+            size_t m_edge;
+        };
+
+        std::vector<uint32_t> discovery(count, UINT32_MAX);
+        std::vector<uint32_t> lowLinks(count, 0);
+        std::vector<bool> onStack(count, false);
+        std::vector<uint32_t> stack;
+        std::vector<Visit> visits;
+        uint32_t time = 0;
+
+        auto visit = [&](const uint32_t v) {
+            discovery[v] = lowLinks[v] = time++;
+            stack.push_back(v);
+            onStack[v] = true;
+            visits.push_back({ v, 0 });
+        };
+
+        for (uint32_t start = 0; start < count; start++) {
+            if (! live[start] || discovery[start] != UINT32_MAX) {
+                continue;
+            }
+
+            visit(start);
+
+            while (! visits.empty()) {
+                Visit& top = visits.back();
+                const uint32_t v = top.m_variable;
+
+                if (top.m_edge < edges[v].size()) {
+                    const uint32_t w = edges[v][top.m_edge];
+                    top.m_edge++;
+
+                    if (discovery[w] == UINT32_MAX) {
+                        visit(w);
+                    }
+                    else if (onStack[w]) {
+                        lowLinks[v] = std::min(lowLinks[v], discovery[w]);
+                    }
+
+                    continue;
+                }
+
+                visits.pop_back();
+
+                if (! visits.empty()) {
+                    const uint32_t parent = visits.back().m_variable;
+                    lowLinks[parent] = std::min(lowLinks[parent], lowLinks[v]);
+                }
+
+                if (lowLinks[v] != discovery[v]) {
+                    continue;
+                }
+
+                // v is the first variable of a component, it consists of everything above it on the stack
+                const bool cyclic = stack.back() != v
+                    || std::find(edges[v].begin(), edges[v].end(), v) != edges[v].end();
+
+                for (;;) {
+                    const uint32_t member = stack.back();
+                    stack.pop_back();
+                    onStack[member] = false;
+
+                    m_derivations[member] = cyclic
+                        ? DerivationCount{ DERIVATIONS_SATURATED, std::numeric_limits<double>::infinity() }
+                        : countVariable(member, pending);
+
+                    if (member == v) {
+                        break;
+                    }
+                }
+            }
+        }
+    };
+
+    // derivations of a variable outside of cycles, all its variables have already been counted
+    // pending is 0 for hash expressions that count
+    DerivationCount countVariable(const uint32_t var, const std::vector<uint32_t>& pending)
+    {
+        const VariableRecord& record = m_variables[var];
+
+        if (record.m_lazy) {
+            const uint64_t size = record.m_expressionsEnd - record.m_expressionsBegin;
+            return { size, std::log2(static_cast<double>(size)) };
+        }
+
+        uint64_t total = 0;
+        double log2 = -std::numeric_limits<double>::infinity();
+
+        for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd; e++) {
+            m_derivationOffsets[e] = total;
+
+            if (pending[e] != 0) {
+                continue;
+            }
+
+            const ExpressionRecord& expr = m_expressions[e];
+            uint64_t product = 1;
+            double productLog2 = 0.0;
+
+            for (uint32_t i = expr.m_identsBegin; i < expr.m_identsEnd; i++) {
+                const DerivationCount& child = m_derivations[m_idents[i]];
+                product = multiplyCounts(product, child.m_count);
+                productLog2 += child.m_log2;
+            }
+
+            total = addCounts(total, product);
+            log2 = addLogarithms(log2, productLog2);
+            m_derivationOffsets[e] = total;
+        }
+
+        // small numbers take the logarithm of the exact value
+        return { total, total == DERIVATIONS_SATURATED ? log2 : std::log2(static_cast<double>(total)) };
+    };
+
+    static uint64_t addCounts(const uint64_t a, const uint64_t b)
+    {
+        return a > DERIVATIONS_SATURATED - b ? DERIVATIONS_SATURATED : a + b;
+    };
+
+    static uint64_t multiplyCounts(const uint64_t a, const uint64_t b)
+    {
+        uint64_t high;
+        uint64_t low;
+        multiply64(a, b, high, low);
+        return high != 0 || low == DERIVATIONS_SATURATED ? DERIVATIONS_SATURATED : low;
+    };
+
+    // binary logarithm of the sum of two numbers given by their binary logarithms
+    static double addLogarithms(const double a, const double b)
+    {
+        const double high = std::max(a, b);
+        const double low = std::min(a, b);
+
+        if (std::isinf(low)) {
+            return high;
+        }
+
+        return high + std::log2(1.0 + std::exp2(low - high));
+    };
+
+    // estimate lengths of all variables
+    // variables outside of cycles are computed exactly, children first
+    // expected lengths of the others are the solution of a linear system, found by repeated substitution
+    // variables that do not depend on recursion are ordered so that every variable comes after all variables it uses
+    // the others are recursive or use some recursive variable
+    void orderVariables(std::vector<uint32_t>& order, std::vector<uint32_t>& recursive) const
+    {
+        const uint32_t count = static_cast<uint32_t>(m_variables.size());
+
+        std::vector<uint32_t> pending(count, 0);
+        std::vector<std::vector<uint32_t>> dependents(count);
+        std::vector<uint32_t> ready;
+        std::vector<bool> known(count, false);
+
+        for (uint32_t v = 0; v < count; v++) {
+            const VariableRecord& record = m_variables[v];
+
+            for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd && ! record.m_lazy; e++) {
+                const ExpressionRecord& expr = m_expressions[e];
+
+                for (uint32_t i = expr.m_identsBegin; i < expr.m_identsEnd; i++) {
+                    dependents[m_idents[i]].push_back(v);
+                    pending[v]++;
+                }
+            }
+
+            if (pending[v] == 0) {
+                ready.push_back(v);
+            }
+        }
+
+        while (! ready.empty()) {
+            const uint32_t v = ready.back();
+            ready.pop_back();
+
+            order.push_back(v);
+            known[v] = true;
+
+            for (const uint32_t u : dependents[v]) {
+                pending[u]--;
+                if (pending[u] == 0) {
+                    ready.push_back(u);
+                }
+            }
+        }
+
+        for (uint32_t v = 0; v < count; v++) {
+            if (! known[v]) {
+                recursive.push_back(v);
+            }
+        }
+    };
+
+    void estimateLengths()
+    {
+        std::vector<uint32_t> order;
+        std::vector<uint32_t> recursive;
+        orderVariables(order, recursive);
+
+        m_lengths.assign(m_variables.size(), { 0.0, 0.0, 0, 0, 0.0, 0.0, 0, 0 });
+
+        for (const uint32_t v : order) {
+            m_lengths[v] = estimateVariable(v);
+        }
+
+        if (recursive.empty()) {
+            return;
+        }
+
+        bool converged = false;
+        double previousTotal = 0.0;
+        double previousIncrement = 0.0;
+        int growing = 0;
+
+        for (int iteration = 0; iteration < ESTIMATE_ITERATIONS && ! converged; iteration++) {
+            converged = true;
+            double total = 0.0;
+
+            for (const uint32_t v : recursive) {
+                const LengthEstimate next = estimateVariable(v);
+                converged = converged 
+                    && isClose(m_lengths[v].m_expectedNatural, next.m_expectedNatural)
+                    && isClose(m_lengths[v].m_expectedProgramming, next.m_expectedProgramming)
+                    && isClose(m_lengths[v].m_expectedExpressions, next.m_expectedExpressions)
+                    && isClose(m_lengths[v].m_expectedUnits, next.m_expectedUnits);
+
+                m_lengths[v] = next;
+                total += next.m_expectedExpressions;
+            }
+
+            // a converging substitution makes smaller and smaller steps
+            // if the steps do not shrink for a while, the recursion is expected to never end
+            const double increment = total - previousTotal;
+            growing = iteration > 0 && increment >= previousIncrement ? growing + 1 : 0;
+            previousTotal = total;
+            previousIncrement = increment;
+
+            if (growing >= ESTIMATE_DIVERGENCE_STEPS) {
+                converged = false;
+                break;
+            }
+        }
+
+        const double infinity = std::numeric_limits<double>::infinity();
+
+        for (const uint32_t v : recursive) {
+            LengthEstimate& estimate = m_lengths[v];
+            estimate.m_maxNatural = LENGTH_UNBOUNDED;
+            estimate.m_maxProgramming = LENGTH_UNBOUNDED;
+
+            if (! converged) {
+                estimate.m_expectedNatural = infinity;
+                estimate.m_expectedProgramming = infinity;
+                estimate.m_expectedExpressions = infinity;
+                estimate.m_expectedUnits = infinity;
+            }
+        }
+    };
+
+    // estimate of a variable out of current estimates of variables it refers to
+    LengthEstimate estimateVariable(const uint32_t var) const
+    {
+        const VariableRecord& record = m_variables[var];
+        LengthEstimate result = { 0.0, 0.0, 0, 0, 0.0, 0.0, 0, 0 };
+
+        if (record.m_lazy) {
+            return estimateLazy(record);
+        }
+
+        for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd; e++) {
+            const ExpressionRecord& expr = m_expressions[e];
+            const int64_t weight = m_weights[e] - (e == record.m_expressionsBegin ? 0 : m_weights[e - 1]);
+            // a single hash expression is drawn every time, whatever its weight, see drawExpression()
+            const double probability = record.m_expressionsEnd - record.m_expressionsBegin == 1
+                ? 1.0 
+                : static_cast<double>(weight) / static_cast<double>(record.m_totalWeight);
+
+            double expressions = 1.0;
+            double units = static_cast<double>(expr.m_naturalEnd - expr.m_naturalBegin) 
+                + static_cast<double>(expr.m_programmingEnd - expr.m_programmingBegin);
+
+            for (uint32_t i = expr.m_identsBegin; i < expr.m_identsEnd; i++) {
+                expressions += m_lengths[m_idents[i]].m_expectedExpressions;
+                units += m_lengths[m_idents[i]].m_expectedUnits;
+            }
+
+            double expected = 0.0;
+            uint64_t max = 0;
+
+            estimateUnits(expr.m_naturalBegin, expr.m_naturalEnd, expr.m_identsBegin, true, expected, max);
+            result.m_expectedNatural += probability * expected;
+            result.m_maxNatural = std::max(result.m_maxNatural, max);
+
+            estimateUnits(expr.m_programmingBegin, expr.m_programmingEnd, expr.m_identsBegin, false, expected, max);
+            result.m_expectedProgramming += probability * expected;
+            result.m_maxProgramming = std::max(result.m_maxProgramming, max);
+
+            result.m_expectedExpressions += probability * expressions;
+            result.m_expectedUnits += probability * units;
+        }
+
+        return result;
+    };
+
+    // the same estimate for lazy hash expressions, every non-empty literal is one unit
+    LengthEstimate estimateLazy(const VariableRecord& record) const
+    {
+        LengthEstimate result = { 0.0, 0.0, 0, 0, 0.0, 0.0, 0, 0 };
+
+        for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd; e++) {
+            const LazyExpression& expr = m_lazyExpressions[e];
+            const int64_t weight = m_lazyWeights[e] - (e == record.m_expressionsBegin ? 0 : m_lazyWeights[e - 1]);
+            const double probability = static_cast<double>(weight) / static_cast<double>(record.m_totalWeight);
+
+            result.m_expectedNatural += probability * static_cast<double>(expr.m_natural.size());
+            result.m_expectedProgramming += probability * static_cast<double>(expr.m_programming.size());
+            result.m_maxNatural = std::max(result.m_maxNatural, static_cast<uint64_t>(expr.m_natural.size()));
+            result.m_maxProgramming = std::max(result.m_maxProgramming, static_cast<uint64_t>(expr.m_programming.size()));
+            result.m_expectedExpressions += probability;
+            result.m_expectedUnits += probability * ((expr.m_natural.empty() ? 0.0 : 1.0) + (expr.m_programming.empty() ? 0.0 : 1.0));
+        }
+
+        return result;
+    };
+
+    void estimateUnits(const uint32_t begin, const uint32_t end, const uint32_t identsBegin, const bool isNatural,
+        double& expected, uint64_t& max) const
+    {
+        expected = 0.0;
+        max = 0;
+
+        for (uint32_t i = begin; i < end; i++) {
+            const UnitRecord& unit = m_units[i];
+
+            if (unit.m_kind == UnitKind::ConstKind) {
+                expected += static_cast<double>(unit.m_length);
+                max = addLengths(max, unit.m_length);
+            }
+            else if (unit.m_kind == UnitKind::VariableKind) {
+                const LengthEstimate& child = m_lengths[m_idents[identsBegin + unit.m_offset]];
+                expected += isNatural ? child.m_expectedNatural : child.m_expectedProgramming;
+                max = addLengths(max, isNatural ? child.m_maxNatural : child.m_maxProgramming);
+            }
+        }
+    };
+
+    // hash expressions of weight 0 are never drawn
+    // variables without any positive weight have been given a uniform distribution, see Variable::seal()
+    static bool isDrawn(const VariableRecord& record, const std::vector<int64_t>& weights, const uint32_t e)
+    {
+        return weights[e] != (e == record.m_expressionsBegin ? 0 : weights[e - 1]);
+    };
+
+    // all values within the inner bounds are also within the outer ones
+    static bool containsBounds(const LengthBounds& outer, const LengthBounds& inner)
+    {
+        return outer.m_minNatural <= inner.m_minNatural && inner.m_maxNatural <= outer.m_maxNatural
+            && outer.m_minProgramming <= inner.m_minProgramming && inner.m_maxProgramming <= outer.m_maxProgramming;
+    };
+
+    // some pair of lengths is within both bounds
+    static bool overlapsBounds(const LengthBounds& a, const LengthBounds& b)
+    {
+        return a.m_minNatural <= b.m_maxNatural && b.m_minNatural <= a.m_maxNatural
+            && a.m_minProgramming <= b.m_maxProgramming && b.m_minProgramming <= a.m_maxProgramming;
+    };
+
+    static bool isClose(const double previous, const double next)
+    {
+        return std::abs(next - previous) <= 1e-9 * std::max(std::abs(next), 1.0);
+    };
+
+    // choose the sampling mode and build the alias table if needed
+    // the table is built in integers, so it preserves the weighted distribution exactly
+    // arrays are either those of compiled hash expressions or those of lazy ones
+    static void prepareSampling(VariableRecord& record, const std::vector<int64_t>& weights,
+        std::vector<uint64_t>& thresholds, std::vector<uint32_t>& aliases)
+    {
+        const uint32_t begin = record.m_expressionsBegin;
+        const uint32_t size = record.m_expressionsEnd - begin;
+        const uint64_t total = static_cast<uint64_t>(record.m_totalWeight);
+
+        thresholds.resize(weights.size(), 0);
+        aliases.resize(weights.size(), 0);
+
+        if (size == 1) {
+            record.m_sampling = SamplingMode::SingleSampling;
+            return;
+        }
+
+        // every weight is scaled by the number of columns, this product has to fit in 64 bits
+        if (size < ALIAS_TABLE_MIN_SIZE || total > UINT64_MAX / size) {
+            record.m_sampling = SamplingMode::SearchSampling;
+            return;
+        }
+
+        record.m_sampling = SamplingMode::AliasSampling;
+
+        // every column has the height of the total weight
+        // columns lower than that are filled up by some higher column
+        std::vector<uint64_t> scaled(size);
+        std::vector<uint32_t> small;
+        std::vector<uint32_t> large;
+
+        for (uint32_t i = 0; i < size; i++) {
+            const int64_t previous = i == 0 ? 0 : weights[begin + i - 1];
+            scaled[i] = static_cast<uint64_t>(weights[begin + i] - previous) * size;
+
+            if (scaled[i] < total) {
+                small.push_back(i);
+            }
+            else {
+                large.push_back(i);
+            }
+        }
+
+        while (! small.empty() && ! large.empty()) {
+            const uint32_t s = small.back();
+            const uint32_t l = large.back();
+            small.pop_back();
+
+            thresholds[begin + s] = scaled[s];
+            aliases[begin + s] = begin + l;
+            scaled[l] -= total - scaled[s];
+
+            if (scaled[l] < total) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+
+        // the arithmetic is exact, so what remains is always full
+        for (const uint32_t l : large) {
+            thresholds[begin + l] = total;
+            aliases[begin + l] = begin + l;
+        }
+
+        for (const uint32_t s : small) {
+            thresholds[begin + s] = total;
+            aliases[begin + s] = begin + s;
+        }
+    };
+
+    bool compileUnits(const units_t& units, const ArenaSpan<const uint32_t>& slots)
+    {
+        for (const Unit* u : units) {
+            UnitRecord record;
+            const uint32_t var = u->getVariable();
+
+            if (var == NO_SYMBOL) {
+                const std::string_view value = u->getString();
+
+                if (! fitsIndex(m_pool.size() + value.size())) {
+                    return false;
+                }
+
+                record.m_kind = UnitKind::ConstKind;
+                record.m_offset = static_cast<uint32_t>(m_pool.size());
+                record.m_length = static_cast<uint32_t>(value.size());
+                m_pool += value;
+            }
+            else {
+                uint32_t slot = 0;
+                while (slots[slot] != var) {
+                    slot++;
+                }
+
+                record.m_kind = UnitKind::VariableKind;
+                record.m_offset = slot;
+                record.m_length = 0;
+            }
+
+            m_units.push_back(record);
+        }
+
+        return true;
+    };
+
+    // the value of a range of units whose variables are all constant
+    // this is the evaluation of the generator done in advance with ordinary strings
+    bool evaluateConstant(const uint32_t begin, const uint32_t end, const uint32_t identsBegin,
+        const std::vector<std::string>& values, std::string& result) const
+    {
+        result.clear();
+        bool omitSpace = false;
+
+        for (uint32_t i = begin; i < end; i++) {
+            const UnitRecord& unit = m_units[i];
+
+            if (unit.m_kind == UnitKind::ConstKind) {
+                std::string_view literal = getLiteral(unit);
+
+                if (omitSpace) {
+                    omitSpace = false;
+
+                    if (! literal.empty() && isSpace(literal[0])) {
+                        literal.remove_prefix(1);
+                    }
+                }
+
+                result += literal;
+            }
+            else {
+                omitSpace = false;
+                const std::string_view add = unit.m_kind == UnitKind::VariableKind
+                    ? std::string_view(values[m_idents[identsBegin + unit.m_offset]])
+                    : std::string_view();
+
+                if (add.empty()) {
+                    if (! result.empty() && isSpace(result.back())) {
+                        result.pop_back();
+                    }
+                    else {
+                        omitSpace = true;
+                    }
+                }
+                else {
+                    result += add;
+                }
+            }
+
+            if (result.size() > FOLDING_MAX_LENGTH) {
+                return false;
+            }
+        }
+
+        return true;
+    };
+
+    // copy a range of units into another grammar
+    // folded variables become string literals and neighbouring string literals are merged into one
+    bool rewriteUnits(const uint32_t begin, const uint32_t end, const uint32_t identsBegin,
+        const std::vector<uint32_t>& slots, const std::vector<std::string>& values, Grammar& result) const
+    {
+        std::string literal;
+        bool hasLiteral = false;
+
+        auto flush = [&]() {
+            if (! hasLiteral) {
+                return true;
+            }
+
+            hasLiteral = false;
+
+            if (! fitsIndex(result.m_pool.size() + literal.size())) {
+                return false;
+            }
+
+            result.m_units.push_back({ UnitKind::ConstKind, static_cast<uint32_t>(result.m_pool.size()), static_cast<uint32_t>(literal.size()) });
+            result.m_pool += literal;
+            return true;
+        };
+
+        // an empty literal still cancels the omitted space, so it is never merged with the next one
+        auto add = [&](const std::string_view value) {
+            if (hasLiteral && ! literal.empty()) {
+                literal += value;
+                return true;
+            }
+
+            if (! flush()) {
+                return false;
+            }
+
+            literal = value;
+            hasLiteral = true;
+            return true;
+        };
+
+        for (uint32_t i = begin; i < end; i++) {
+            const UnitRecord& unit = m_units[i];
+            bool success = true;
+
+            if (unit.m_kind == UnitKind::ConstKind) {
+                success = add(getLiteral(unit));
+            }
+            else if (unit.m_kind == UnitKind::VariableKind && slots[unit.m_offset] != UINT32_MAX) {
+                success = flush();
+                result.m_units.push_back({ UnitKind::VariableKind, slots[unit.m_offset], 0 });
+            }
+            else {
+                const std::string_view value = unit.m_kind == UnitKind::VariableKind
+                    ? std::string_view(values[m_idents[identsBegin + unit.m_offset]])
+                    : std::string_view();
+
+                if (value.empty()) {
+                    success = flush();
+                    result.m_units.push_back({ UnitKind::EmptyKind, 0, 0 });
+                }
+                else {
+                    success = add(value);
+                }
+            }
+
+            if (! success) {
+                return false;
+            }
+        }
+
+        return flush();
+    };
+
+    bool unitsConsistent(const uint32_t begin, const uint32_t end, const uint32_t slots) const
+    {
+        if (begin > end || end > m_units.size()) {
+            return false;
+        }
+
+        for (uint32_t i = begin; i < end; i++) {
+            const UnitRecord& unit = m_units[i];
+
+            const bool valid = unit.m_kind == UnitKind::ConstKind
+                ? static_cast<uint64_t>(unit.m_offset) + unit.m_length <= m_pool.size()
+                : unit.m_kind == UnitKind::EmptyKind || (unit.m_kind == UnitKind::VariableKind && unit.m_offset < slots);
+
+            if (! valid) {
+                return false;
+            }
+        }
+
+        return true;
+    };
+
+    static bool fitsIndex(const size_t value)
+    {
+        return value <= static_cast<size_t>(UINT32_MAX);
+    };
+
+    // a variable can be lazy if all its hash expressions are string literals that are drawn sometimes
+    // so it has no variables to evaluate, no derivations to skip and it is never folded
+    static bool isLiteralPool(const Variable& variable)
+    {
+        const std::vector<HashExpression>& hashExpressions = variable.getHashExpressions();
+        const std::vector<int64_t>& weights = variable.getWeights();
+
+        if (hashExpressions.size() < LAZY_MIN_EXPRESSIONS) {
+            return false;
+        }
+
+        for (size_t i = 0; i < hashExpressions.size(); i++) {
+            const HashExpression& he = hashExpressions[i];
+
+            if (! he.m_uniqueIdents.empty() || he.m_natural.size() > 1 || he.m_programming.size() > 1
+                || weights[i] == (i == 0 ? 0 : weights[i - 1]))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    };
+
+    // a line of string literals is at most one unit, a view of the source file
+    static std::string_view getSourceLiteral(const units_t& units)
+    {
+        return units.empty() ? std::string_view() : units[0]->getString();
+    };
+
+    bool lazyConsistent(const VariableRecord& record) const
+    {
+        if (record.m_expressionsBegin >= record.m_expressionsEnd
+            || record.m_expressionsEnd > m_lazyExpressions.size()
+            || record.m_sampling > SamplingMode::AliasSampling)
+        {
+            return false;
+        }
+
+        if (record.m_sampling == SamplingMode::AliasSampling) {
+            for (uint32_t i = record.m_expressionsBegin; i < record.m_expressionsEnd; i++) {
+                if (m_lazyAliases[i] < record.m_expressionsBegin || m_lazyAliases[i] >= record.m_expressionsEnd) {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    };
+};
+
+
+// piece of an evaluated text
+// it is either a span of some string literal or a prefix of an already evaluated fragment
+struct Piece
+{
+    // points into the string pool, nullptr if this piece refers to a fragment
+    const char* m_data;
+    uint32_t m_fragment;
+    size_t m_length;
+};
+
+
+// evaluated text of a variable
+// it does not own characters, it is a range of pieces that are concatenated only at the very end
+struct Fragment
+{
+    uint32_t m_piecesBegin;
+    uint32_t m_piecesEnd;
+    size_t m_length;
+};
+
+
+// evaluated value of a variable bound to some slot of a hash expression
+struct Slot
+{
+    uint32_t m_natural;
+    uint32_t m_programming;
+};
+
+
+// hash expression on the explicit stack of the evaluation
+struct Frame
+{
+    uint32_t m_expression;
+    // next unique variable to be evaluated
+    uint32_t m_ident;
+    // slots of this hash expression start here
+    uint32_t m_slotsBase;
+};
+
+
+// bounds of the final length of one field during length-bounded sampling
+// every variable still to be evaluated counts with its shortest and longest value
+struct FieldBounds
+{
+    // the lower bound is m_lower - m_removed
+    // m_removed counts characters that can be removed next to empty variables of hash expressions already drawn
+    uint64_t m_lower;
+    uint64_t m_removed;
+    // the upper bound is finite only if no variable still to be evaluated is unbounded
+    uint64_t m_upper;
+    uint64_t m_unbounded;
+};
+
+
+// how many times a variable of some hash expression appears in the final values
+struct FrameCopies
+{
+    uint64_t m_natural;
+    uint64_t m_programming;
+};
+
+
+// fragment on the explicit stack of the final concatenation
+struct WriteFrame
+{
+    uint32_t m_piece;
+    uint32_t m_piecesEnd;
+    // how many characters are still to be written
+    size_t m_length;
+};
+
+
+// this section of code provides sinks
+// sink is any object that receives generated values directly from the evaluation
+// without intermediate strings, it has to provide these methods:
+//
+//   void beginSample();
+//   void beginField(SampleField field, size_t length);   // length of the whole field is known in advance
+//   void append(const char* data, size_t size);          // called many times for one field
+//   void endField();
+//   void endSample();
+//
+// every sample consists of the natural field followed by the programming field
+
+enum SampleField
+{
+    NaturalField,
+    ProgrammingField
+};
+
+
+// size of the buffer of built-in writers
+static constexpr size_t WRITER_BUFFER_SIZE = 1 << 20;
+
+// alignment of the buffer of built-in writers, it matches pages of memory
+static constexpr size_t WRITER_BUFFER_ALIGNMENT = 4096;
+
+// number of buffers of the asynchronous target, more of them absorb longer stalls of the disk
+static constexpr size_t ASYNC_TARGET_BUFFERS = 4;
+
+
+// destination of bytes written by built-in writers
+struct OutputTarget
+{
+public:
+    virtual ~OutputTarget() = default;
+    virtual bool write(const char* data, size_t size) = 0;
+};
+
+
+// standard C file opened for writing
+struct FileTarget : OutputTarget
+{
+public:
+    FileTarget() = delete;
+    FileTarget(std::FILE* file) : m_file(file) { };
+
+    bool write(const char* data, size_t size) override
+    {
+        return std::fwrite(data, 1, size, m_file) == size;
+    };
+
+private:
+    std::FILE* m_file;
+};
+
+
+// file descriptor opened for writing
+struct DescriptorTarget : OutputTarget
+{
+public:
+    DescriptorTarget() = delete;
+    DescriptorTarget(const int descriptor) : m_descriptor(descriptor) { };
+
+    bool write(const char* data, size_t size) override
+    {
+        while (size != 0) {
+
+#ifdef _WIN32
+            const unsigned int chunk = static_cast<unsigned int>(std::min(size, static_cast<size_t>(INT32_MAX)));
+            const int written = _write(m_descriptor, data, chunk);
+#else
+            const ssize_t written = ::write(m_descriptor, data, size);
+#endif
+
+            if (written <= 0) {
+                return false;
+            }
+
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+
+        return true;
+    };
+
+private:
+    const int m_descriptor;
+};
+
+
+// bytes are appended to a string in memory
+struct StringTarget : OutputTarget
+{
+public:
+    StringTarget() = delete;
+    StringTarget(std::string& result) : m_result(result) { };
+
+    bool write(const char* data, size_t size) override
+    {
+        m_result.append(data, size);
+        return true;
+    };
+
+private:
+    std::string& m_result;
+};
+
+
+struct AlignedDeleter
+{
+    void operator()(char* ptr) const
+    {
+        ::operator delete(ptr, std::align_val_t(WRITER_BUFFER_ALIGNMENT));
+    };
+};
+
+
+// bytes are passed to another target by a background thread, so slow disks do not stop generation
+// they are collected in a few aligned buffers and the target gets them whole, in order
+// when all buffers wait for the target, write() waits too
+// only one thread at a time should write and the result of the target is known after flush()
+struct AsyncTarget : OutputTarget
+{
+public:
+    AsyncTarget() = delete;
+    AsyncTarget(const AsyncTarget&) = delete;
+    AsyncTarget& operator=(const AsyncTarget&) = delete;
+
+    AsyncTarget(OutputTarget& target)
+        : AsyncTarget(target, WRITER_BUFFER_SIZE, ASYNC_TARGET_BUFFERS) { };
+
+    AsyncTarget(OutputTarget& target, const size_t capacity, const size_t buffers)
+        : m_target(target), m_capacity(std::max(capacity, static_cast<size_t>(1)))
+    {
+        const size_t count = std::max(buffers, static_cast<size_t>(2));
+
+        for (size_t i = 0; i < count; i++) {
+            m_buffers.emplace_back(static_cast<char*>(::operator new(m_capacity, std::align_val_t(WRITER_BUFFER_ALIGNMENT))));
+            m_free.push_back(m_buffers.back().get());
+        }
+
+        m_thread = std::thread(&AsyncTarget::run, this);
+    };
+
+    ~AsyncTarget()
+    {
+        flush();
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+
+        m_queued.notify_one();
+        m_thread.join();
+    };
+
+    bool write(const char* data, size_t size) override
+    {
+        while (size != 0) {
+            if (m_current == nullptr) {
+                acquire();
+            }
+
+            const size_t len = std::min(size, m_capacity - m_size);
+            std::memcpy(m_current + m_size, data, len);
+            m_size += len;
+            data += len;
+            size -= len;
+
+            if (m_size == m_capacity) {
+                submit();
+            }
+        }
+
+        return m_good.load(std::memory_order_relaxed);
+    };
+
+    // wait until the target gets all bytes written so far
+    bool flush()
+    {
+        if (m_current != nullptr) {
+            submit();
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_freed.wait(lock, [this]() { return m_pending.empty() && ! m_busy; });
+        return m_good.load(std::memory_order_relaxed);
+    };
+
+    // false if the target has failed at least once
+    bool isGood() const
+    {
+        return m_good.load(std::memory_order_relaxed);
+    };
+
+    // how many times write() had to wait for the target
+    uint64_t getStalls() const
+    {
+        return m_stalls;
+    };
+
+private:
+
+    void acquire()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        if (m_free.empty()) {
+            m_stalls++;
+            m_freed.wait(lock, [this]() { return ! m_free.empty(); });
+        }
+
+        m_current = m_free.back();
+        m_free.pop_back();
+        m_size = 0;
+    };
+
+    void submit()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending.emplace_back(m_current, m_size);
+        }
+
+        m_queued.notify_one();
+        m_current = nullptr;
+        m_size = 0;
+    };
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        while (true) {
+            m_queued.wait(lock, [this]() { return m_stopping || ! m_pending.empty(); });
+
+            if (m_pending.empty()) {
+                return;
+            }
+
+            const std::pair<char*, size_t> chunk = m_pending.front();
+            m_pending.pop_front();
+            m_busy = true;
+            lock.unlock();
+
+            if (! m_target.write(chunk.first, chunk.second)) {
+                m_good.store(false, std::memory_order_relaxed);
+            }
+
+            lock.lock();
+            m_free.push_back(chunk.first);
+            m_busy = false;
+            m_freed.notify_all();
+        }
+    };
+
+    OutputTarget& m_target;
+    const size_t m_capacity;
+    std::vector<std::unique_ptr<char[], AlignedDeleter>> m_buffers;
+
+    // the buffer being filled belongs to the writing thread
+    char* m_current = nullptr;
+    size_t m_size = 0;
+    uint64_t m_stalls = 0;
+
+    std::mutex m_mutex;
+    std::condition_variable m_queued;
+    std::condition_variable m_freed;
+    std::vector<char*> m_free;
+    std::deque<std::pair<char*, size_t>> m_pending;
+    bool m_busy = false;
+    bool m_stopping = false;
+    std::atomic<bool> m_good = true;
+    std::thread m_thread;
+};
+
+
+// common part of built-in writers
+// bytes are collected in a big aligned buffer and passed to the target only when it is full
+class BufferedWriter
+{
+public:
+    BufferedWriter() = delete;
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator=(const BufferedWriter&) = delete;
+
+    BufferedWriter(OutputTarget& target) 
+        : BufferedWriter(target, WRITER_BUFFER_SIZE) { };
+
+    BufferedWriter(OutputTarget& target, const size_t capacity) 
+        : m_target(target), 
+          m_buffer(static_cast<char*>(::operator new(std::max(capacity, static_cast<size_t>(1)), 
+            std::align_val_t(WRITER_BUFFER_ALIGNMENT)))),
+          m_capacity(std::max(capacity, static_cast<size_t>(1))) { };
+
+    ~BufferedWriter()
+    {
+        flush();
+    };
+
+    // pass all buffered bytes to the target
+    bool flush()
+    {
+        if (m_size != 0) {
+            m_good = m_target.write(m_buffer.get(), m_size) && m_good;
+            m_size = 0;
+        }
+
+        return m_good;
+    };
+
+    // false if the target has failed at least once
+    bool isGood() const
+    {
+        return m_good;
+    };
+
+protected:
+    // the output cannot be written correctly, the target itself is fine
+    void fail()
+    {
+        m_good = false;
+    };
+
+    void put(const char* data, size_t size)
+    {
+        while (size != 0) {
+            if (m_size == m_capacity) {
+                flush();
+            }
+
+            const size_t len = std::min(size, m_capacity - m_size);
+            std::memcpy(m_buffer.get() + m_size, data, len);
+            m_size += len;
+            data += len;
+            size -= len;
+        }
+    };
+
+    void put(const char ch)
+    {
+        if (m_size == m_capacity) {
+            flush();
+        }
+
+        m_buffer[m_size++] = ch;
+    };
+
+private:
+    OutputTarget& m_target;
+    std::unique_ptr<char[], AlignedDeleter> m_buffer;
+    const size_t m_capacity;
+    size_t m_size = 0;
+    bool m_good = true;
+};
+
+
+// one JSON object per line
+// {"natural":"...","programming":"..."}
+class JsonlWriter : public BufferedWriter
+{
+public:
+    using BufferedWriter::BufferedWriter;
+
+    void beginSample()
+    {
+        put('{');
+    };
+
+    void beginField(const SampleField field, const size_t /*length*/)
+    {
+        if (field == SampleField::NaturalField) {
+            put("\"natural\":\"", 11);
+        }
+        else {
+            put(",\"programming\":\"", 16);
+        }
+    };
+
+    void append(const char* data, const size_t size)
+    {
+        static constexpr char HEX[] = "0123456789abcdef";
+        size_t start = 0;
+
+        for (size_t i = 0; i < size; i++) {
+            const unsigned char ch = static_cast<unsigned char>(data[i]);
+
+            if (ch >= 0x20 && ch != '"' && ch != '\\') {
+                continue;
+            }
+
+            put(data + start, i - start);
+            start = i + 1;
+
+            switch (ch) {
+                case '"': put("\\\"", 2); break;
+                case '\\': put("\\\\", 2); break;
+                case '\n': put("\\n", 2); break;
+                case '\r': put("\\r", 2); break;
+                case '\t': put("\\t", 2); break;
+                default: {
+                    const char escaped[] = { '\\', 'u', '0', '0', HEX[ch >> 4], HEX[ch & 15] };
+                    put(escaped, 6);
+                    break;
+                }
+            }
+        }
+
+        put(data + start, size - start);
+    };
+
+    void endField()
+    {
+        put('"');
+    };
+
+    void endSample()
+    {
+        put("}\n", 2);
+    };
+};
+
+
+// one line per sample, natural and programming separated by a tab
+// backslashes, tabs and line breaks are escaped with a backslash
+class TsvWriter : public BufferedWriter
+{
+public:
+    using BufferedWriter::BufferedWriter;
+
+    void beginSample() { };
+
+    void beginField(const SampleField field, const size_t /*length*/)
+    {
+        if (field == SampleField::ProgrammingField) {
+            put('\t');
+        }
+    };
+
+    void append(const char* data, const size_t size)
+    {
+        size_t start = 0;
+
+        for (size_t i = 0; i < size; i++) {
+            const char ch = data[i];
+
+            if (ch != '\\' && ch != '\t' && ch != '\n' && ch != '\r') {
+                continue;
+            }
+
+            put(data + start, i - start);
+            start = i + 1;
+            put('\\');
+            put(ch == '\t' ? 't' : (ch == '\n' ? 'n' : (ch == '\r' ? 'r' : '\\')));
+        }
+
+        put(data + start, size - start);
+    };
+
+    void endField() { };
+
+    void endSample()
+    {
+        put('\n');
+    };
+};
+
+
+// every field is its length as a little-endian 32-bit integer followed by raw bytes
+// a field of 4 GiB or more does not fit, then the output ends before it and the writer fails
+class BinaryWriter : public BufferedWriter
+{
+public:
+    using BufferedWriter::BufferedWriter;
+
+    void beginSample() { };
+
+    void beginField(const SampleField /*field*/, const size_t length)
+    {
+        if (length > UINT32_MAX) {
+            m_overflow = true;
+            fail();
+        }
+
+        if (m_overflow) {
+            return;
+        }
+
+        const uint32_t value = static_cast<uint32_t>(length);
+        const char bytes[] = {
+            static_cast<char>(value & 0xff),
+            static_cast<char>((value >> 8) & 0xff),
+            static_cast<char>((value >> 16) & 0xff),
+            static_cast<char>((value >> 24) & 0xff)
+        };
+        put(bytes, 4);
+    };
+
+    void append(const char* data, const size_t size)
+    {
+        if (! m_overflow) {
+            put(data, size);
+        }
+    };
+
+    void endField() { };
+    void endSample() { };
+
+private:
+    bool m_overflow = false;
+};
+
+
+// many samples as a structure of arrays
+// values of each field are concatenated in one buffer and value i is [offsets[i], offsets[i + 1]) of it
+// this is the layout of Arrow arrays of type large_binary (or large_utf8 for UTF-8 codebases)
+// so the buffers can be handed over to Arrow, NumPy or a tokenizer without millions of small strings
+struct SampleBatch
+{
+public:
+    SampleBatch()
+    {
+        clear();
+    };
+
+    void clear()
+    {
+        m_natural.clear();
+        m_programming.clear();
+        m_naturalOffsets.assign(1, 0);
+        m_programmingOffsets.assign(1, 0);
+        m_validity.clear();
+        m_size = 0;
+    };
+
+    // number of samples
+    size_t size() const
+    {
+        return m_size;
+    };
+
+    std::string_view getNatural(const size_t index) const
+    {
+        return getValue(m_natural, m_naturalOffsets, index);
+    };
+
+    std::string_view getProgramming(const size_t index) const
+    {
+        return getValue(m_programming, m_programmingOffsets, index);
+    };
+
+    // false if the sample could not be generated, then both its values are empty
+    bool isValid(const size_t index) const
+    {
+        return (m_validity[index / 8] >> (index % 8)) & 1;
+    };
+
+    // end the sample whose values have just been appended to the buffers
+    void pushSample(const bool valid)
+    {
+        m_naturalOffsets.push_back(static_cast<int64_t>(m_natural.size()));
+        m_programmingOffsets.push_back(static_cast<int64_t>(m_programming.size()));
+
+        if (m_size % 8 == 0) {
+            m_validity.push_back(0);
+        }
+
+        if (valid) {
+            m_validity.back() |= static_cast<uint8_t>(1 << (m_size % 8));
+        }
+
+        m_size++;
+    };
+
+    // append all samples of another batch
+    void append(const SampleBatch& other)
+    {
+        const int64_t naturalBase = static_cast<int64_t>(m_natural.size());
+        const int64_t programmingBase = static_cast<int64_t>(m_programming.size());
+
+        m_natural.insert(m_natural.end(), other.m_natural.begin(), other.m_natural.end());
+        m_programming.insert(m_programming.end(), other.m_programming.begin(), other.m_programming.end());
+
+        for (size_t i = 0; i < other.m_size; i++) {
+            m_naturalOffsets.push_back(naturalBase + other.m_naturalOffsets[i + 1]);
+            m_programmingOffsets.push_back(programmingBase + other.m_programmingOffsets[i + 1]);
+
+            if (m_size % 8 == 0) {
+                m_validity.push_back(0);
+            }
+
+            m_validity.back() |= static_cast<uint8_t>(other.isValid(i) << (m_size % 8));
+            m_size++;
+        }
+    };
+
+    // characters of all values of the field
+    std::vector<char> m_natural;
+    std::vector<char> m_programming;
+    // size() + 1 offsets of values in the buffers, the first one is 0
+    std::vector<int64_t> m_naturalOffsets;
+    std::vector<int64_t> m_programmingOffsets;
+    // bit i (counted from the least significant bit of every byte) is 1 if sample i is valid
+    // this is the validity bitmap of Arrow
+    std::vector<uint8_t> m_validity;
+
+private:
+    static std::string_view getValue(const std::vector<char>& buffer, const std::vector<int64_t>& offsets, const size_t index)
+    {
+        return std::string_view(buffer.data() + offsets[index], static_cast<size_t>(offsets[index + 1] - offsets[index]));
+    };
+
+    size_t m_size;
+};
+
+
+// sink that appends samples to a batch
+class ColumnWriter
+{
+public:
+    ColumnWriter() = delete;
+    ColumnWriter(SampleBatch& batch) : m_batch(batch) { };
+
+    void beginSample() { };
+
+    void beginField(const SampleField field, const size_t length)
+    {
+        m_buffer = field == SampleField::NaturalField ? &m_batch.m_natural : &m_batch.m_programming;
+
+        // the whole field fits at once, but the buffer still grows geometrically
+        if (m_buffer->capacity() - m_buffer->size() < length) {
+            m_buffer->reserve(std::max(2 * m_buffer->capacity(), m_buffer->size() + length));
+        }
+    };
+
+    void append(const char* data, const size_t size)
+    {
+        m_buffer->insert(m_buffer->end(), data, data + size);
+    };
+
+    void endField() { };
+
+    void endSample()
+    {
+        m_batch.pushSample(true);
+    };
+
+private:
+    SampleBatch& m_batch;
+    std::vector<char>* m_buffer = nullptr;
+};
+
+
+// this section of code collects statistics of generation
+
+// what reports of statistics are sorted by
+enum StatisticsOrder
+{
+    CountOrder,
+    BytesOrder,
+    TimeOrder
+};
+
+
+// one line of a report of statistics
+struct RuleStatistics
+{
+    std::string m_variable;
+    // position of the hash expression among hash expressions of the variable
+    // -1 if the line describes the whole variable
+    int64_t m_expression;
+    uint64_t m_count;
+    // characters of both values produced by the rule, including values of nested variables
+    uint64_t m_bytes;
+    // time of evaluation, including nested variables
+    uint64_t m_nanoseconds;
+};
+
+
+// counters of one generator
+// every generator (and so every thread) has its own counters, they are merged only when somebody asks for them
+// indices are the ones of the compiled grammar, so folded variables are not counted separately
+class Statistics
+{
+public:
+    Statistics() = default;
+
+    Statistics(const Grammar& grammar)
+        : m_variables(grammar.m_variables.size()), m_expressions(grammar.m_expressions.size()) { };
+
+    void merge(const Statistics& other)
+    {
+        m_variables.resize(std::max(m_variables.size(), other.m_variables.size()));
+        m_expressions.resize(std::max(m_expressions.size(), other.m_expressions.size()));
+        m_depths.resize(std::max(m_depths.size(), other.m_depths.size()), 0);
+
+        for (size_t i = 0; i < other.m_variables.size(); i++) {
+            m_variables[i].add(other.m_variables[i]);
+        }
+
+        for (size_t i = 0; i < other.m_expressions.size(); i++) {
+            m_expressions[i].add(other.m_expressions[i]);
+        }
+
+        for (size_t i = 0; i < other.m_depths.size(); i++) {
+            m_depths[i] += other.m_depths[i];
+        }
+
+        m_samples += other.m_samples;
+        m_failures += other.m_failures;
+        m_nanoseconds += other.m_nanoseconds;
+    };
+
+    // number of samples, successful or not
+    uint64_t getSamples() const
+    {
+        return m_samples;
+    };
+
+    // number of samples that failed because of the recursion level limit
+    uint64_t getFailures() const
+    {
+        return m_failures;
+    };
+
+    uint64_t getNanoseconds() const
+    {
+        return m_nanoseconds;
+    };
+
+    // element d is the number of samples whose deepest nesting of variables was d
+    const std::vector<uint64_t>& getDepthHistogram() const
+    {
+        return m_depths;
+    };
+
+    // the most frequent, the biggest or the slowest variables
+    std::vector<RuleStatistics> getTopVariables(const Grammar& grammar, const size_t n, const StatisticsOrder order) const
+    {
+        std::vector<RuleStatistics> result;
+
+        for (size_t v = 0; v < m_variables.size() && v < grammar.m_variables.size(); v++) {
+            const Counter& c = m_variables[v];
+            result.push_back({ grammar.m_names[v], -1, c.m_count, c.m_bytes, c.m_nanoseconds });
+        }
+
+        return getTop(std::move(result), n, order);
+    };
+
+    // the most frequent, the biggest or the slowest hash expressions
+    std::vector<RuleStatistics> getTopExpressions(const Grammar& grammar, const size_t n, const StatisticsOrder order) const
+    {
+        std::vector<RuleStatistics> result;
+
+        for (size_t v = 0; v < grammar.m_variables.size(); v++) {
+            const VariableRecord& record = grammar.m_variables[v];
+
+            // hash expressions of lazy variables are not counted one by one
+            if (record.m_lazy) {
+                continue;
+            }
+
+            for (uint32_t e = record.m_expressionsBegin; e < record.m_expressionsEnd && e < m_expressions.size(); e++) {
+                const Counter& c = m_expressions[e];
+                result.push_back({ grammar.m_names[v], static_cast<int64_t>(e - record.m_expressionsBegin), 
+                    c.m_count, c.m_bytes, c.m_nanoseconds });
+            }
+        }
+
+        return getTop(std::move(result), n, order);
+    };
+
+    // events of the evaluation, they are called by generators
+
+    void beginSample()
+    {
+        m_open.clear();
+        m_sampleStart = std::chrono::steady_clock::now();
+        m_sampleDepth = 0;
+    };
+
+    void enter(const uint32_t var, const uint32_t expr, const size_t depth)
+    {
+        m_open.push_back({ var, expr, std::chrono::steady_clock::now() });
+        m_sampleDepth = std::max(m_sampleDepth, depth);
+    };
+
+    void leave(const uint64_t bytes)
+    {
+        const OpenRule& rule = m_open.back();
+        const uint64_t nanoseconds = elapsed(rule.m_start);
+
+        m_variables[rule.m_variable].add(1, bytes, nanoseconds);
+        m_expressions[rule.m_expression].add(1, bytes, nanoseconds);
+        m_open.pop_back();
+    };
+
+    // a lazy variable is evaluated at once, so only the variable is counted
+    void visit(const uint32_t var, const uint64_t bytes, const size_t depth)
+    {
+        m_variables[var].add(1, bytes, 0);
+        m_sampleDepth = std::max(m_sampleDepth, depth);
+    };
+
+    void endSample(const bool success)
+    {
+        if (m_depths.size() <= m_sampleDepth) {
+            m_depths.resize(m_sampleDepth + 1, 0);
+        }
+
+        m_depths[m_sampleDepth]++;
+        m_samples++;
+        m_nanoseconds += elapsed(m_sampleStart);
+
+        if (! success) {
+            m_failures++;
+        }
+    };
+
+private:
+    struct Counter
+    {
+        uint64_t m_count = 0;
+        uint64_t m_bytes = 0;
+        uint64_t m_nanoseconds = 0;
+
+        void add(const uint64_t count, const uint64_t bytes, const uint64_t nanoseconds)
+        {
+            m_count += count;
+            m_bytes += bytes;
+            m_nanoseconds += nanoseconds;
+        };
+
+        void add(const Counter& other)
+        {
+            add(other.m_count, other.m_bytes, other.m_nanoseconds);
+        };
+    };
+
+    // variable whose evaluation has not finished yet
+    struct OpenRule
+    {
+        uint32_t m_variable;
+        uint32_t m_expression;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    static uint64_t elapsed(const std::chrono::steady_clock::time_point start)
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    };
+
+    static std::vector<RuleStatistics> getTop(std::vector<RuleStatistics> rules, const size_t n, const StatisticsOrder order)
+    {
+        auto key = [order](const RuleStatistics& rule) {
+            switch (order) {
+                case StatisticsOrder::BytesOrder:
+                    return rule.m_bytes;
+                case StatisticsOrder::TimeOrder:
+                    return rule.m_nanoseconds;
+                default:
+                    return rule.m_count;
+            }
+        };
+
+        const size_t size = std::min(n, rules.size());
+
+        std::partial_sort(rules.begin(), rules.begin() + size, rules.end(), 
+            [&key](const RuleStatistics& a, const RuleStatistics& b) { return key(a) > key(b); });
+
+        rules.resize(size);
+        return rules;
+    };
+
+    std::vector<Counter> m_variables;
+    std::vector<Counter> m_expressions;
+    std::vector<uint64_t> m_depths;
+    uint64_t m_samples = 0;
+    uint64_t m_failures = 0;
+    uint64_t m_nanoseconds = 0;
+
+    std::vector<OpenRule> m_open;
+    std::chrono::steady_clock::time_point m_sampleStart;
+    size_t m_sampleDepth = 0;
+};
+
+
+// this section of code removes duplicate samples during generation
+
+// 128-bit fingerprint of a whole sample
+struct SampleHash
+{
+    uint64_t m_low;
+    uint64_t m_high;
+
+    bool operator==(const SampleHash& other) const
+    {
+        return m_low == other.m_low && m_high == other.m_high;
+    };
+};
+
+
+struct SampleHashHasher
+{
+    size_t operator()(const SampleHash& hash) const
+    {
+        return static_cast<size_t>(hash.m_low);
+    };
+};
+
+
+// streaming hash of both values of a sample
+// characters can arrive in pieces of any size, the result depends only on the fields and their content
+// it works as a sink, so it reads evaluated fragments directly and no string is built
+// it is fast and well mixed, but not cryptographic
+class SampleHasher
+{
+public:
+    void beginSample()
+    {
+        m_low = 0x736f6d6570736575ULL;
+        m_high = 0x646f72616e646f6dULL;
+        m_word = 0;
+        m_filled = 0;
+    };
+
+    // the length separates fields, so ("ab", "c") and ("a", "bc") differ
+    void beginField(const SampleField field, const size_t length)
+    {
+        mixWord(static_cast<uint64_t>(length) ^ (static_cast<uint64_t>(field) << 63));
+    };
+
+    void append(const char* data, size_t size)
+    {
+        while (size > 0 && m_filled != 0) {
+            appendByte(*data);
+            data++;
+            size--;
+        }
+
+        while (size >= sizeof(uint64_t)) {
+            uint64_t word;
+            std::memcpy(&word, data, sizeof(uint64_t));
+            mixWord(word);
+            data += sizeof(uint64_t);
+            size -= sizeof(uint64_t);
+        }
+
+        while (size > 0) {
+            appendByte(*data);
+            data++;
+            size--;
+        }
+    };
+
+    void endField()
+    {
+        if (m_filled != 0) {
+            mixWord(m_word);
+            m_word = 0;
+            m_filled = 0;
+        }
+    };
+
+    void endSample() { };
+
+    SampleHash getHash() const
+    {
+        return { mix64(m_low ^ mix64(m_high)), mix64(m_high + 0x9e3779b97f4a7c15ULL) ^ m_low };
+    };
+
+private:
+    void appendByte(const char ch)
+    {
+        m_word |= static_cast<uint64_t>(static_cast<unsigned char>(ch)) << (m_filled * 8);
+        m_filled++;
+
+        if (m_filled == sizeof(uint64_t)) {
+            mixWord(m_word);
+            m_word = 0;
+            m_filled = 0;
+        }
+    };
+
+    void mixWord(const uint64_t word)
+    {
+        m_low = rotateLeft((m_low ^ word) * 0x9fb21c651e98df25ULL, 29);
+        m_high = rotateLeft((m_high + word) * 0xc2b2ae3d27d4eb4fULL, 31) ^ m_low;
+    };
+
+    static uint64_t rotateLeft(const uint64_t value, const int shift)
+    {
+        return (value << shift) | (value >> (64 - shift));
+    };
+
+    uint64_t m_low = 0;
+    uint64_t m_high = 0;
+    // characters that do not make a whole word yet
+    uint64_t m_word = 0;
+    size_t m_filled = 0;
+};
+
+
+enum DedupMode
+{
+    // set of fingerprints of all samples, for small runs
+    // its memory grows with the number of unique samples, about 16 bytes each plus the overhead of the set
+    ExactDedup,
+    // Bloom filter of a fixed size
+    // some unique samples are taken for duplicates, the more samples it holds, the more often
+    BloomDedup
+};
+
+
+// how many times a generator draws a sample again if it turned out to be a duplicate
+// a sample is given up after that, so exhausted grammars do not loop forever
+static constexpr int64_t DEDUP_ATTEMPTS = 64;
+
+// how many times a generator draws a sample again if it did not fit into the length bounds
+static constexpr int64_t LENGTH_ATTEMPTS = 64;
+
+// bigger upper bounds of lengths are treated as unbounded during the evaluation, so their sums never overflow
+static constexpr uint64_t LENGTH_TERM_LIMIT = UINT32_MAX;
+
+// bits of one hash function of the Bloom filter, every hash function selects one bit of a block of 512 bits
+static constexpr int BLOOM_BLOCK_BITS = 9;
+
+// number of hash functions of the Bloom filter
+// it is optimal for about 10 bits per sample, then 1% of unique samples is rejected
+static constexpr int BLOOM_HASHES = 6;
+
+// number of independent parts of the exact set, every part has its own lock
+static constexpr size_t EXACT_DEDUP_SHARDS = 64;
+
+
+// filter of samples that have already been generated
+// one filter can be shared by many generators and threads, for example within generateBatch()
+// then it is not deterministic which one of two equal samples is taken first
+class DedupFilter
+{
+public:
+    DedupFilter() = delete;
+    DedupFilter(const DedupFilter&) = delete;
+    DedupFilter& operator=(const DedupFilter&) = delete;
+
+    // memory = size of the Bloom filter in bytes, it is rounded up to whole blocks of 64 bytes
+    // the exact filter ignores it
+    DedupFilter(const DedupMode mode, const size_t memory)
+        : m_mode(mode)
+    {
+        if (m_mode == DedupMode::BloomDedup) {
+            m_blocks = std::max((memory + BLOOM_BLOCK_BYTES - 1) / BLOOM_BLOCK_BYTES, static_cast<size_t>(1));
+            m_bits.reset(new std::atomic<uint64_t>[m_blocks * BLOOM_BLOCK_WORDS]);
+            clearBits();
+        }
+        else {
+            m_shards.reset(new Shard[EXACT_DEDUP_SHARDS]);
+        }
+    };
+
+    // returns true if the sample has not been seen yet, then it is remembered
+    bool insert(const SampleHash& hash)
+    {
+        m_checks++;
+        const bool unique = m_mode == DedupMode::BloomDedup ? insertBloom(hash) : insertExact(hash);
+
+        if (! unique) {
+            m_duplicates++;
+        }
+
+        return unique;
+    };
+
+    // generators report here a sample they gave up after DEDUP_ATTEMPTS duplicates
+    void giveUp()
+    {
+        m_exhausted++;
+    };
+
+    // forget all samples and counters
+    // no generator may use the filter at the same time
+    void clear()
+    {
+        if (m_mode == DedupMode::BloomDedup) {
+            clearBits();
+        }
+        else {
+            for (size_t i = 0; i < EXACT_DEDUP_SHARDS; i++) {
+                m_shards[i].m_hashes.clear();
+            }
+        }
+
+        m_checks = 0;
+        m_duplicates = 0;
+        m_exhausted = 0;
+    };
+
+    DedupMode getMode() const
+    {
+        return m_mode;
+    };
+
+    // number of drawn samples, including duplicates
+    uint64_t getChecks() const
+    {
+        return m_checks;
+    };
+
+    uint64_t getDuplicates() const
+    {
+        return m_duplicates;
+    };
+
+    // number of samples given up because every attempt was a duplicate
+    // if it keeps growing, the space of values of the grammar is exhausted
+    uint64_t getExhausted() const
+    {
+        return m_exhausted;
+    };
+
+    // fraction of drawn samples that were duplicates
+    double getDuplicateRate() const
+    {
+        const uint64_t checks = m_checks;
+        return checks == 0 ? 0.0 : static_cast<double>(m_duplicates) / static_cast<double>(checks);
+    };
+
+private:
+    static constexpr size_t BLOOM_BLOCK_WORDS = (1 << BLOOM_BLOCK_BITS) / 64;
+    static constexpr size_t BLOOM_BLOCK_BYTES = BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+
+    struct Shard
+    {
+        std::mutex m_mutex;
+        std::unordered_set<SampleHash, SampleHashHasher> m_hashes;
+    };
+
+    // all bits of one sample lie in the same block, so it touches only one cache line
+    // bits are set atomically, so threads never lock
+    bool insertBloom(const SampleHash& hash)
+    {
+        std::atomic<uint64_t>* block = m_bits.get() + static_cast<size_t>(m_blocks == 1 ? 0 : hash.m_low % m_blocks) * BLOOM_BLOCK_WORDS;
+        uint64_t bits = hash.m_high;
+        bool unique = false;
+
+        for (int i = 0; i < BLOOM_HASHES; i++) {
+            const uint64_t bit = bits & ((1 << BLOOM_BLOCK_BITS) - 1);
+            bits >>= BLOOM_BLOCK_BITS;
+
+            const uint64_t mask = 1ULL << (bit % 64);
+            if ((block[bit / 64].fetch_or(mask, std::memory_order_relaxed) & mask) == 0) {
+                unique = true;
+            }
+        }
+
+        return unique;
+    };
+
+    bool insertExact(const SampleHash& hash)
+    {
+        Shard& shard = m_shards[static_cast<size_t>(hash.m_high % EXACT_DEDUP_SHARDS)];
+        std::lock_guard<std::mutex> lock(shard.m_mutex);
+        return shard.m_hashes.insert(hash).second;
+    };
+
+    void clearBits()
+    {
+        for (size_t i = 0; i < m_blocks * BLOOM_BLOCK_WORDS; i++) {
+            m_bits[i].store(0, std::memory_order_relaxed);
+        }
+    };
+
+    const DedupMode m_mode;
+
+    size_t m_blocks = 0;
+    std::unique_ptr<std::atomic<uint64_t>[]> m_bits;
+    std::unique_ptr<Shard[]> m_shards;
+
+    std::atomic<uint64_t> m_checks { 0 };
+    std::atomic<uint64_t> m_duplicates { 0 };
+    std::atomic<uint64_t> m_exhausted { 0 };
+};
+
+
+// the latest version of a grammar, shared by generators that follow it
+// grammars are immutable, so a new version is swapped in as a whole and the old one lives
+// as long as some generator still evaluates a sample of it
+class GrammarSource
+{
+public:
+    GrammarSource() = delete;
+    GrammarSource(const GrammarSource&) = delete;
+    GrammarSource& operator=(const GrammarSource&) = delete;
+
+    GrammarSource(const std::shared_ptr<const Grammar>& grammar)
+        : m_grammar(grammar) { };
+
+    std::shared_ptr<const Grammar> get() const
+    {
+        return std::atomic_load(&m_grammar);
+    };
+
+    // it grows whenever a new grammar is published, it is cheap enough to be checked before every sample
+    uint64_t getVersion() const
+    {
+        return m_version.load(std::memory_order_acquire);
+    };
+
+    void publish(const std::shared_ptr<const Grammar>& grammar)
+    {
+        std::atomic_store(&m_grammar, grammar);
+        m_version.fetch_add(1, std::memory_order_release);
+    };
+
+private:
+    std::shared_ptr<const Grammar> m_grammar;
+    std::atomic<uint64_t> m_version { 0 };
+};
+
+
+// the scratch arena of a generator is reserved up front only up to this number of elements
+static constexpr size_t ARENA_RESERVE_LIMIT = 1 << 16;
+
+
+// generator produces random values out of some grammar
+// the grammar is immutable and can be shared by many generators
+// while the generator itself holds only the random engine and the scratch arena
+// so use one generator per thread
+// samples are reproducible, sample number k of stream s depends only on (seed, s, k)
+template<typename Engine>
+class BasicGenerator
+{
+public:
+    BasicGenerator() = delete;
+
+    BasicGenerator(const std::shared_ptr<const Grammar>& grammar, const uint64_t seed, const uint64_t stream)
+        : m_grammar(grammar), m_randomness(seed), m_seed(seed), m_stream(stream)
+    {
+        if (m_grammar != nullptr) {
+            reserveArena();
+        }
+    };
+
+    // call this to generate a new pair of values
+    // it is the sample of the current index, then the index is incremented
+    bool next(std::string& natural, std::string& programming)
+    {
+        natural.clear();
+        programming.clear();
+
+        if (! draw()) {
+            return false;
+        }
+
+        writeSample(natural, programming);
+        return true;
+    };
+
+    // generate a new pair of values directly into some sink
+    // it takes the same sample as next(natural, programming) would
+    template<typename Sink>
+    bool next(Sink& sink)
+    {
+        if (! draw()) {
+            return false;
+        }
+
+        writeSample(sink);
+        return true;
+    };
+
+    // generate the derivation number 'index' of the root, no random numbers are drawn
+    // every index below the number of derivations of the root gives another derivation, see Grammar::getDerivations()
+    // only derivations that next() can give are numbered, hash expressions of weight 0 are skipped like in Variable::seal()
+    // returns false if the index is out of this range or the root has too many derivations to be numbered by 64 bits
+    bool generateAt(const uint64_t index, std::string& natural, std::string& programming)
+    {
+        natural.clear();
+        programming.clear();
+
+        if (! evaluateAt(index)) {
+            return false;
+        }
+
+        writeSample(natural, programming);
+        return true;
+    };
+
+    template<typename Sink>
+    bool generateAt(const uint64_t index, Sink& sink)
+    {
+        if (! evaluateAt(index)) {
+            return false;
+        }
+
+        writeSample(sink);
+        return true;
+    };
+
+    // set new recursion level limit
+    // evaluation uses an explicit stack, so even huge limits do not crash the program
+    // they only allow fractals to use more memory and time
+    void setLevelLimit(const int64_t limit)
+    {
+        m_levelLimit = limit;
+    };
+
+    int64_t getLevelLimit() const
+    {
+        return m_levelLimit;
+    };
+
+    // the deepest nesting of variables allowed by depth-bounded sampling, 0 turns it off
+    // then hash expressions are drawn only among those that can finish within the remaining depth
+    // so samples never fail because of the recursion level limit, nothing is evaluated in vain
+    // hash expressions that could never finish in time are excluded, the others keep the proportions of their weights
+    // values are the same as without the budget as long as all hash expressions of variables fit into it
+    void setDepthBudget(const int64_t budget)
+    {
+        m_depthBudget = budget;
+    };
+
+    int64_t getDepthBudget() const
+    {
+        return m_depthBudget;
+    };
+
+    // only samples with lengths of values within these bounds are generated, in characters
+    // hash expressions that cannot give values within the remaining bounds are excluded, the others keep the proportions of their weights
+    // the evaluation stops as soon as the bounds cannot be satisfied anymore and the sample is drawn again, LENGTH_ATTEMPTS times at most
+    // bounds of lengths of variables are not exact, so some samples are found out of bounds only at the end
+    // but they never exclude a hash expression that could still give values within the bounds
+    // values are the same as without the bounds as long as all hash expressions fit into them
+    // generateAt() ignores the bounds
+    void setLengthBounds(const LengthBounds& bounds)
+    {
+        m_lengthBounds = bounds;
+        m_bounded = bounds.m_minNatural != 0 || bounds.m_maxNatural != LENGTH_UNBOUNDED
+            || bounds.m_minProgramming != 0 || bounds.m_maxProgramming != LENGTH_UNBOUNDED;
+    };
+
+    const LengthBounds& getLengthBounds() const
+    {
+        return m_lengthBounds;
+    };
+
+    // jump to any sample of the stream
+    void seek(const uint64_t index)
+    {
+        m_index = index;
+    };
+
+    // index of the sample generated by the next call of next()
+    uint64_t getIndex() const
+    {
+        return m_index;
+    };
+
+    uint64_t getSeed() const
+    {
+        return m_seed;
+    };
+
+    uint64_t getStream() const
+    {
+        return m_stream;
+    };
+
+    const std::shared_ptr<const Grammar>& getGrammar() const
+    {
+        return m_grammar;
+    };
+
+    // follow the latest grammar of the source, nullptr stays with the current grammar
+    // a new grammar is taken before the next sample, so the sample in progress finishes on the old one
+    // statistics start from zero then, because they refer to rules of the grammar
+    void setSource(const std::shared_ptr<const GrammarSource>& source)
+    {
+        m_source = source;
+
+        if (m_source != nullptr) {
+            m_version = m_source->getVersion();
+            changeGrammar(m_source->get());
+        }
+    };
+
+    const std::shared_ptr<const GrammarSource>& getSource() const
+    {
+        return m_source;
+    };
+
+    // start counting statistics of generation from zero
+    void enableStatistics()
+    {
+        m_statistics.emplace(*m_grammar);
+    };
+
+    // nullptr if statistics are not enabled
+    const Statistics* getStatistics() const
+    {
+        return m_statistics ? &*m_statistics : nullptr;
+    };
+
+    // every sample is checked against the filter and drawn again if it is a duplicate
+    // redraws do not move the index, so sample k of the stream is still the first unique draw of its own seed
+    // nullptr turns deduplication off
+    void setFilter(const std::shared_ptr<DedupFilter>& filter)
+    {
+        m_filter = filter;
+    };
+
+    const std::shared_ptr<DedupFilter>& getFilter() const
+    {
+        return m_filter;
+    };
+
+private:
+
+    // take the new grammar if the source has published one
+    // returns false if there is no grammar at all
+    bool refresh()
+    {
+        if (m_source != nullptr && m_source->getVersion() != m_version) {
+            m_version = m_source->getVersion();
+            changeGrammar(m_source->get());
+        }
+
+        return m_grammar != nullptr;
+    };
+
+    void changeGrammar(const std::shared_ptr<const Grammar>& grammar)
+    {
+        if (grammar == m_grammar || grammar == nullptr) {
+            return;
+        }
+
+        m_grammar = grammar;
+        reserveArena();
+
+        if (m_statistics) {
+            m_statistics.emplace(*m_grammar);
+        }
+    };
+
+    void writeSample(std::string& natural, std::string& programming)
+    {
+        const uint32_t n = m_slots[0].m_natural;
+        const uint32_t p = m_slots[0].m_programming;
+
+        // every character is copied only once, right here
+        natural.reserve(m_fragments[n].m_length);
+        programming.reserve(m_fragments[p].m_length);
+        writeFragment(n, m_fragments[n].m_length, natural);
+        writeFragment(p, m_fragments[p].m_length, programming);
+    };
+
+    template<typename Sink>
+    void writeSample(Sink& sink)
+    {
+        const uint32_t n = m_slots[0].m_natural;
+        const uint32_t p = m_slots[0].m_programming;
+
+        sink.beginSample();
+        sink.beginField(SampleField::NaturalField, m_fragments[n].m_length);
+        writeFragment(n, m_fragments[n].m_length, sink);
+        sink.endField();
+        sink.beginField(SampleField::ProgrammingField, m_fragments[p].m_length);
+        writeFragment(p, m_fragments[p].m_length, sink);
+        sink.endField();
+        sink.endSample();
+    };
+
+    // evaluate the derivation of the given number instead of a random one
+    bool evaluateAt(const uint64_t index)
+    {
+        if (! refresh()) {
+            return false;
+        }
+
+        const uint64_t size = m_grammar->getDerivations(m_grammar->m_root).m_count;
+
+        if (size == DERIVATIONS_SATURATED || index >= size) {
+            return false;
+        }
+
+        m_rank = index;
+        m_ranked = true;
+        const bool success = evaluate();
+        m_ranked = false;
+        return success;
+    };
+
+    // evaluate the sample of the current index, then the index is incremented
+    bool draw()
+    {
+        const uint64_t seed = sampleSeed(m_seed, m_stream, m_index);
+        m_index++;
+
+        if (! refresh()) {
+            return false;
+        }
+
+        m_randomness.seed(seed);
+
+        if (m_filter == nullptr && ! m_bounded) {
+            return evaluate();
+        }
+
+        int64_t duplicates = 0;
+        int64_t misses = 0;
+
+        for (int64_t attempt = 1; ; attempt++) {
+            if (! evaluate()) {
+                misses++;
+
+                // without length bounds, the sample failed because of the recursion level limit and it would fail again
+                if (! m_bounded || misses == LENGTH_ATTEMPTS) {
+                    return false;
+                }
+            }
+            else {
+                if (m_filter == nullptr || m_filter->insert(hashSample())) {
+                    return true;
+                }
+
+                duplicates++;
+
+                if (duplicates == DEDUP_ATTEMPTS) {
+                    m_filter->giveUp();
+                    return false;
+                }
+            }
+
+            m_randomness.seed(mix64(seed + static_cast<uint64_t>(attempt) * 0x9e3779b97f4a7c15ULL));
+        }
+    };
+
+    // fingerprint of the evaluated sample, taken before any character is written
+    SampleHash hashSample()
+    {
+        const uint32_t n = m_slots[0].m_natural;
+        const uint32_t p = m_slots[0].m_programming;
+
+        m_hasher.beginSample();
+        m_hasher.beginField(SampleField::NaturalField, m_fragments[n].m_length);
+        writeFragment(n, m_fragments[n].m_length, m_hasher);
+        m_hasher.endField();
+        m_hasher.beginField(SampleField::ProgrammingField, m_fragments[p].m_length);
+        writeFragment(p, m_fragments[p].m_length, m_hasher);
+        m_hasher.endField();
+        return m_hasher.getHash();
+    };
+
+    // the scratch arena starts with the size of an average sample, so typical samples never grow it
+    void reserveArena()
+    {
+        const LengthEstimate& root = m_grammar->m_lengths[m_grammar->m_root];
+
+        m_fragments.reserve(reservedSize(2.0 * root.m_expectedExpressions));
+        m_pieces.reserve(reservedSize(root.m_expectedUnits));
+    };
+
+    static size_t reservedSize(const double expected)
+    {
+        return expected < static_cast<double>(ARENA_RESERVE_LIMIT) 
+            ? static_cast<size_t>(expected) + 1
+            : ARENA_RESERVE_LIMIT;
+    };
+
+    // evaluation does not build strings
+    // values of variables are stored as fragments in the scratch arena and referenced by their indices
+    // variables are evaluated depth-first with an explicit stack of hash expressions
+    // when it succeeds, the value of the root is the only slot left
+    bool evaluate()
+    {
+        if (m_statistics) {
+            m_statistics->beginSample();
+            const bool success = evaluateSample();
+            m_statistics->endSample(success);
+            return success;
+        }
+
+        return evaluateSample();
+    };
+
+    bool evaluateSample()
+    {
+        m_pieces.clear();
+        m_fragments.clear();
+        m_slots.clear();
+        m_frames.clear();
+        m_ranks.clear();
+        m_copies.clear();
+
+        const bool bounded = m_bounded && ! m_ranked;
+
+        if (bounded) {
+            const LengthEstimate& root = m_grammar->m_lengths[m_grammar->m_root];
+            m_naturalBounds = { lowerTerm(1, root.m_minNatural), 0, 0, 0 };
+            m_programmingBounds = { lowerTerm(1, root.m_minProgramming), 0, 0, 0 };
+            addTerm(m_naturalBounds, 1, root.m_maxNatural);
+            addTerm(m_programmingBounds, 1, root.m_maxProgramming);
+        }
+
+        if (! pushFrame(m_grammar->m_root)) {
+            return false;
+        }
+
+        while (! m_frames.empty()) {
+            Frame& frame = m_frames.back();
+            const ExpressionRecord& expr = m_grammar->m_expressions[frame.m_expression];
+
+            // every unique variable of this hash expression is evaluated once and bound to its slot
+            if (frame.m_ident != expr.m_identsEnd) {
+                const uint32_t var = m_grammar->m_idents[frame.m_ident];
+                frame.m_ident++;
+
+                if (static_cast<int64_t>(m_frames.size()) >= m_levelLimit || ! pushFrame(var)) {
+                    return false;
+                }
+
+                continue;
+            }
+
+            const uint32_t base = frame.m_slotsBase;
+            Slot value;
+            value.m_natural = buildFragment(expr.m_naturalBegin, expr.m_naturalEnd, base, true);
+            value.m_programming = buildFragment(expr.m_programmingBegin, expr.m_programmingEnd, base, false);
+
+            if (m_statistics) {
+                m_statistics->leave(m_fragments[value.m_natural].m_length + m_fragments[value.m_programming].m_length);
+            }
+
+            m_frames.pop_back();
+            m_slots.resize(base);
+            m_slots.push_back(value);
+
+            if (m_ranked) {
+                m_ranks.pop_back();
+            }
+
+            if (bounded) {
+                m_copies.resize(m_copies.size() - (expr.m_identsEnd - expr.m_identsBegin));
+            }
+        }
+
+        // shortest values are not exact, so the final lengths are checked again
+        if (bounded) {
+            const uint64_t natural = m_fragments[m_slots[0].m_natural].m_length;
+            const uint64_t programming = m_fragments[m_slots[0].m_programming].m_length;
+
+            return m_lengthBounds.m_minNatural <= natural && natural <= m_lengthBounds.m_maxNatural
+                && m_lengthBounds.m_minProgramming <= programming && programming <= m_lengthBounds.m_maxProgramming;
+        }
+
+        return true;
+    };
+
+    // returns false if the variable cannot finish within the depth budget or the length bounds
+    bool pushFrame(const uint32_t var)
+    {
+        uint32_t expr;
+        uint64_t rank = 0;
+
+        if (m_ranked) {
+            // the number of the derivation of a hash expression is split into digits of mixed radix
+            // one digit for every unique variable, in the order of their evaluation
+            rank = m_rank;
+
+            if (! m_ranks.empty()) {
+                const uint64_t radix = m_grammar->getDerivations(var).m_count;
+                rank = m_ranks.back() % radix;
+                m_ranks.back() /= radix;
+            }
+
+            expr = m_grammar->getExpressionAt(var, rank);
+        }
+        else if (m_bounded) {
+            uint32_t maxHeight = HEIGHT_UNBOUNDED;
+
+            if (m_depthBudget > 0 && ! getMaxHeight(var, maxHeight)) {
+                return false;
+            }
+
+            // the evaluation stops here if no hash expression can give values within the bounds
+            expr = fitExpression(var, maxHeight);
+
+            if (expr == NO_EXPRESSION) {
+                return false;
+            }
+        }
+        else if (m_depthBudget > 0) {
+            uint32_t maxHeight;
+
+            if (! getMaxHeight(var, maxHeight)) {
+                return false;
+            }
+
+            expr = m_grammar->getBoundedExpression(var, maxHeight, m_randomness);
+        }
+        else {
+            expr = m_grammar->getRandomExpression(var, m_randomness);
+        }
+
+        // a lazy variable has no variables to wait for, so it goes straight into its slot
+        if (m_grammar->m_variables[var].m_lazy) {
+            pushLiterals(var, m_grammar->m_lazyExpressions[expr]);
+            return true;
+        }
+
+        if (m_ranked) {
+            m_ranks.push_back(rank);
+        }
+
+        m_frames.push_back({ expr, m_grammar->m_expressions[expr].m_identsBegin, static_cast<uint32_t>(m_slots.size()) });
+
+        if (m_statistics) {
+            m_statistics->enter(var, expr, m_frames.size());
+        }
+
+        return true;
+    };
+
+    // this variable and everything nested in it has to fit within the depth budget
+    bool getMaxHeight(const uint32_t var, uint32_t& maxHeight) const
+    {
+        const int64_t remaining = std::min(m_depthBudget, m_levelLimit) - static_cast<int64_t>(m_frames.size());
+
+        if (remaining < static_cast<int64_t>(m_grammar->getMinimumDepth(var))) {
+            return false;
+        }
+
+        maxHeight = static_cast<uint32_t>(std::min(remaining, static_cast<int64_t>(HEIGHT_UNBOUNDED - 1)));
+        return true;
+    };
+
+    // draw a hash expression that can still give values within the length bounds and update the bounds
+    // the variable is the next one of the hash expression on the top of the stack
+    uint32_t fitExpression(const uint32_t var, const uint32_t maxHeight)
+    {
+        FrameCopies copies = { 1, 1 };
+
+        if (! m_frames.empty()) {
+            const Frame& frame = m_frames.back();
+            const ExpressionRecord& parent = m_grammar->m_expressions[frame.m_expression];
+            copies = m_copies[m_copies.size() - (parent.m_identsEnd - frame.m_ident) - 1];
+        }
+
+        const LengthEstimate& estimate = m_grammar->m_lengths[var];
+        LengthBounds window;
+
+        if (! fitWindow(m_naturalBounds, copies.m_natural, estimate.m_minNatural, estimate.m_maxNatural,
+                m_lengthBounds.m_minNatural, m_lengthBounds.m_maxNatural, window.m_minNatural, window.m_maxNatural)
+            || ! fitWindow(m_programmingBounds, copies.m_programming, estimate.m_minProgramming, estimate.m_maxProgramming,
+                m_lengthBounds.m_minProgramming, m_lengthBounds.m_maxProgramming, window.m_minProgramming, window.m_maxProgramming))
+        {
+            return NO_EXPRESSION;
+        }
+
+        const uint32_t expr = m_grammar->getFittingExpression(var, window, maxHeight, m_randomness);
+
+        if (expr == NO_EXPRESSION) {
+            return NO_EXPRESSION;
+        }
+
+        // the variable counted with its shortest and longest value so far, now its hash expression is known
+        m_naturalBounds.m_lower -= lowerTerm(copies.m_natural, estimate.m_minNatural);
+        m_programmingBounds.m_lower -= lowerTerm(copies.m_programming, estimate.m_minProgramming);
+        removeTerm(m_naturalBounds, copies.m_natural, estimate.m_maxNatural);
+        removeTerm(m_programmingBounds, copies.m_programming, estimate.m_maxProgramming);
+
+        if (m_grammar->m_variables[var].m_lazy) {
+            const LazyExpression& literals = m_grammar->m_lazyExpressions[expr];
+            m_naturalBounds.m_lower += lowerTerm(copies.m_natural, literals.m_natural.size());
+            m_programmingBounds.m_lower += lowerTerm(copies.m_programming, literals.m_programming.size());
+            addTerm(m_naturalBounds, copies.m_natural, literals.m_natural.size());
+            addTerm(m_programmingBounds, copies.m_programming, literals.m_programming.size());
+            return expr;
+        }
+
+        // copies of unique variables of the hash expression, they are popped together with its frame
+        const ExpressionRecord& record = m_grammar->m_expressions[expr];
+        const size_t base = m_copies.size();
+        m_copies.resize(base + (record.m_identsEnd - record.m_identsBegin), { 0, 0 });
+        countCopies(record.m_naturalBegin, record.m_naturalEnd, record.m_identsBegin, copies.m_natural, base, true);
+        countCopies(record.m_programmingBegin, record.m_programmingEnd, record.m_identsBegin, copies.m_programming, base, false);
+
+        for (size_t i = base; i < m_copies.size(); i++) {
+            const LengthEstimate& child = m_grammar->m_lengths[m_grammar->m_idents[record.m_identsBegin + (i - base)]];
+            m_naturalBounds.m_lower += lowerTerm(m_copies[i].m_natural, child.m_minNatural);
+            m_programmingBounds.m_lower += lowerTerm(m_copies[i].m_programming, child.m_minProgramming);
+            addTerm(m_naturalBounds, m_copies[i].m_natural, child.m_maxNatural);
+            addTerm(m_programmingBounds, m_copies[i].m_programming, child.m_maxProgramming);
+        }
+
+        return expr;
+    };
+
+    // the range of lengths of one field a hash expression of the variable can have, so the whole value can still fit
+    // the variable appears 'copies' times in the field, 0 if it does not appear there
+    static bool fitWindow(const FieldBounds& field, const uint64_t copies, const uint64_t min, const uint64_t max,
+        const uint64_t lowest, const uint64_t highest, uint64_t& low, uint64_t& high)
+    {
+        low = 0;
+        high = LENGTH_UNBOUNDED;
+
+        if (copies == 0) {
+            return true;
+        }
+
+        // other variables take at least their shortest values
+        // removed characters are not subtracted from them, but added to the maximum, so nothing goes below 0
+        if (highest != LENGTH_UNBOUNDED) {
+            const uint64_t others = field.m_lower - lowerTerm(copies, min);
+            const uint64_t budget = addLengths(highest, field.m_removed);
+
+            if (others > budget) {
+                return false;
+            }
+
+            high = (budget - others) / copies;
+        }
+
+        // other variables take at most their longest values, it is known only if all of them are bounded
+        const uint64_t term = boundedTerm(copies, max);
+        const bool unbounded = term == LENGTH_UNBOUNDED;
+
+        if (lowest != 0 && field.m_unbounded == (unbounded ? 1 : 0)) {
+            const uint64_t rest = unbounded ? field.m_upper : field.m_upper - term;
+
+            if (rest < lowest) {
+                low = (lowest - rest - 1) / copies + 1;
+            }
+        }
+
+        return true;
+    };
+
+    // add copies of variables of a range of compiled units, and their literals to the bounds
+    // every variable that can be empty can remove one character, like in Grammar::minimumExpression()
+    void countCopies(const uint32_t begin, const uint32_t end, const uint32_t identsBegin, const uint64_t copies, 
+        const size_t base, const bool isNatural)
+    {
+        if (copies == 0) {
+            return;
+        }
+
+        FieldBounds& field = isNatural ? m_naturalBounds : m_programmingBounds;
+        uint64_t literals = 0;
+        uint64_t removed = 0;
+
+        for (uint32_t i = begin; i < end; i++) {
+            const UnitRecord& unit = m_grammar->m_units[i];
+
+            if (unit.m_kind == UnitKind::ConstKind) {
+                literals = addLengths(literals, unit.m_length);
+            }
+            else if (unit.m_kind == UnitKind::VariableKind) {
+                FrameCopies& slot = m_copies[base + unit.m_offset];
+                const LengthEstimate& child = m_grammar->m_lengths[m_grammar->m_idents[identsBegin + unit.m_offset]];
+
+                if (isNatural) {
+                    slot.m_natural = addLengths(slot.m_natural, copies);
+                }
+                else {
+                    slot.m_programming = addLengths(slot.m_programming, copies);
+                }
+
+                if ((isNatural ? child.m_minNatural : child.m_minProgramming) == 0) {
+                    removed++;
+                }
+            }
+            else {
+                removed++;
+            }
+        }
+
+        field.m_lower += lowerTerm(copies, literals);
+        field.m_removed = addLengths(field.m_removed, multiplyLengths(copies, removed));
+        addTerm(field, copies, literals);
+    };
+
+    // shorter lower bounds are still lower bounds, so big ones are cut and their sums never overflow
+    static uint64_t lowerTerm(const uint64_t copies, const uint64_t length)
+    {
+        return std::min(multiplyLengths(copies, length), LENGTH_TERM_LIMIT);
+    };
+
+    static uint64_t boundedTerm(const uint64_t copies, const uint64_t length)
+    {
+        const uint64_t term = multiplyLengths(copies, length);
+        return term > LENGTH_TERM_LIMIT ? LENGTH_UNBOUNDED : term;
+    };
+
+    static void addTerm(FieldBounds& field, const uint64_t copies, const uint64_t length)
+    {
+        const uint64_t term = boundedTerm(copies, length);
+
+        if (term == LENGTH_UNBOUNDED) {
+            field.m_unbounded++;
+        }
+        else {
+            field.m_upper += term;
+        }
+    };
+
+    static void removeTerm(FieldBounds& field, const uint64_t copies, const uint64_t length)
+    {
+        const uint64_t term = boundedTerm(copies, length);
+
+        if (term == LENGTH_UNBOUNDED) {
+            field.m_unbounded--;
+        }
+        else {
+            field.m_upper -= term;
+        }
+    };
+
+    void pushLiterals(const uint32_t var, const LazyExpression& expr)
+    {
+        Slot value;
+        value.m_natural = buildLiteral(expr.m_natural);
+        value.m_programming = buildLiteral(expr.m_programming);
+
+        if (m_statistics) {
+            m_statistics->visit(var, expr.m_natural.size() + expr.m_programming.size(), m_frames.size() + 1);
+        }
+
+        m_slots.push_back(value);
+    };
+
+    // fragment of a single string literal
+    uint32_t buildLiteral(const std::string_view literal)
+    {
+        Fragment fragment;
+        fragment.m_piecesBegin = static_cast<uint32_t>(m_pieces.size());
+        fragment.m_length = literal.size();
+
+        if (! literal.empty()) {
+            m_pieces.push_back({ literal.data(), 0, literal.size() });
+        }
+
+        fragment.m_piecesEnd = static_cast<uint32_t>(m_pieces.size());
+        m_fragments.push_back(fragment);
+        return static_cast<uint32_t>(m_fragments.size() - 1);
+    };
+
+    // make a new fragment out of a range of compiled units
+    // values of variables have already been evaluated into slots starting from base
+    uint32_t buildFragment(const uint32_t begin, const uint32_t end, const size_t base, const bool isNatural)
+    {
+        Fragment fragment;
+        fragment.m_piecesBegin = static_cast<uint32_t>(m_pieces.size());
+        fragment.m_length = 0;
+        bool omitSpace = false;
+
+        for (uint32_t i = begin; i < end; i++) {
+            const UnitRecord& unit = m_grammar->m_units[i];
+
+            if (unit.m_kind == UnitKind::ConstKind) {
+                std::string_view literal = m_grammar->getLiteral(unit);
+
+                if (omitSpace) {
+                    omitSpace = false;
+
+                    if (! literal.empty() && isSpace(literal[0])) {
+                        literal.remove_prefix(1);
+                    }
+                }
+
+                if (! literal.empty()) {
+                    m_pieces.push_back({ literal.data(), 0, literal.size() });
+                    fragment.m_length += literal.size();
+                }
+            }
+            else {
+                omitSpace = false;
+                uint32_t add = 0;
+                size_t addLength = 0;
+
+                if (unit.m_kind == UnitKind::VariableKind) {
+                    const Slot& slot = m_slots[base + unit.m_offset];
+                    add = isNatural ? slot.m_natural : slot.m_programming;
+                    addLength = m_fragments[add].m_length;
+                }
+
+                if (addLength == 0) {
+                    if (fragment.m_length != 0 && isSpace(lastChar())) {
+                        removeLastChar();
+                        fragment.m_length--;
+                    }
+                    else {
+                        omitSpace = true;
+                    }
+                }
+                else {
+                    m_pieces.push_back({ nullptr, add, addLength });
+                    fragment.m_length += addLength;
+                }
+            }
+        }
+
+        fragment.m_piecesEnd = static_cast<uint32_t>(m_pieces.size());
+        m_fragments.push_back(fragment);
+        return static_cast<uint32_t>(m_fragments.size() - 1);
+    };
+
+    // last character of the fragment being built right now
+    // pieces are never empty
+    char lastChar() const
+    {
+        const Piece& last = m_pieces.back();
+        return last.m_data == nullptr
+            ? charAt(last.m_fragment, last.m_length - 1)
+            : last.m_data[last.m_length - 1];
+    };
+
+    char charAt(uint32_t fragment, size_t position) const
+    {
+        for (;;) {
+            const Fragment& f = m_fragments[fragment];
+
+            for (uint32_t i = f.m_piecesBegin; i < f.m_piecesEnd; i++) {
+                const Piece& piece = m_pieces[i];
+
+                if (position >= piece.m_length) {
+                    position -= piece.m_length;
+                }
+                else if (piece.m_data == nullptr) {
+                    fragment = piece.m_fragment;
+                    break;
+                }
+                else {
+                    return piece.m_data[position];
+                }
+            }
+        }
+    };
+
+    // characters are not copied yet, so we only shorten the last piece
+    void removeLastChar()
+    {
+        Piece& last = m_pieces.back();
+        last.m_length--;
+
+        if (last.m_length == 0) {
+            m_pieces.pop_back();
+        }
+    };
+
+    // copy the first 'length' characters of an evaluated fragment
+    // the result is a string or a sink
+    template<typename Output>
+    void writeFragment(const uint32_t fragment, const size_t length, Output& result)
+    {
+        m_writeFrames.clear();
+        m_writeFrames.push_back({ m_fragments[fragment].m_piecesBegin, m_fragments[fragment].m_piecesEnd, length });
+
+        while (! m_writeFrames.empty()) {
+            WriteFrame& frame = m_writeFrames.back();
+
+            if (frame.m_piece == frame.m_piecesEnd || frame.m_length == 0) {
+                m_writeFrames.pop_back();
+                continue;
+            }
+
+            const Piece& piece = m_pieces[frame.m_piece];
+            const size_t len = std::min(piece.m_length, frame.m_length);
+            frame.m_piece++;
+            frame.m_length -= len;
+
+            if (piece.m_data == nullptr) {
+                const Fragment& f = m_fragments[piece.m_fragment];
+                m_writeFrames.push_back({ f.m_piecesBegin, f.m_piecesEnd, len });
+            }
+            else {
+                result.append(piece.m_data, len);
+            }
+        }
+    };
+
+    std::shared_ptr<const Grammar> m_grammar;
+    Engine m_randomness;
+    const uint64_t m_seed;
+    const uint64_t m_stream;
+    uint64_t m_index = 0;
+    
+    // this mechanism protects us from fractals that never end
+    // if too many variables are nested, the next() function is forced to fail
+    // the depth of nesting is the size of m_frames
+    int64_t m_levelLimit = DEFAULT_RECURSION_LEVEL_LIMIT;
+    int64_t m_depthBudget = 0;
+
+    // length-bounded sampling keeps bounds of final lengths of values during the evaluation
+    // m_copies holds copies of unique variables of every hash expression on the stack, see fitExpression()
+    bool m_bounded = false;
+    LengthBounds m_lengthBounds;
+    FieldBounds m_naturalBounds;
+    FieldBounds m_programmingBounds;
+    std::vector<FrameCopies> m_copies;
+
+    // scratch arena of the evaluation
+    // these arrays are reused between calls of next(), so they rarely allocate
+    std::vector<Piece> m_pieces;
+    std::vector<Fragment> m_fragments;
+    // values of variables of all hash expressions currently being evaluated
+    std::vector<Slot> m_slots;
+    std::vector<Frame> m_frames;
+    std::vector<WriteFrame> m_writeFrames;
+
+    // numbered derivations of generateAt() take hash expressions from here instead of random numbers
+    // m_ranks is parallel to m_frames, it holds the remaining digits of their numbers
+    bool m_ranked = false;
+    uint64_t m_rank = 0;
+    std::vector<uint64_t> m_ranks;
+
+    // empty unless statistics are enabled, then every evaluation reports to it
+    std::optional<Statistics> m_statistics;
+
+    // nullptr unless deduplication is enabled
+    std::shared_ptr<DedupFilter> m_filter;
+    SampleHasher m_hasher;
+
+    // nullptr unless the generator follows new versions of the grammar
+    std::shared_ptr<const GrammarSource> m_source;
+    uint64_t m_version = 0;
+};
+
+
+// enumerator walks numbered derivations of the root one after another, see BasicGenerator::generateAt()
+// every derivation of the range is produced exactly once, so no deduplication is needed
+// disjoint ranges can be given to other threads or machines
+template<typename Engine>
+class BasicEnumerator
+{
+public:
+    BasicEnumerator() = delete;
+
+    // the range of derivations [begin, end), it is cut to the number of derivations of the root
+    // it is empty if that number is unbounded or does not fit into 64 bits
+    BasicEnumerator(const std::shared_ptr<const Grammar>& grammar, const uint64_t begin, const uint64_t end)
+        : m_generator(grammar, 0, 0), m_index(begin), m_end(std::min(end, getSize(grammar)))
+    { };
+
+    // the whole range of derivations
+    BasicEnumerator(const std::shared_ptr<const Grammar>& grammar)
+        : BasicEnumerator(grammar, 0, DERIVATIONS_SATURATED)
+    { };
+
+    // returns false when there are no derivations left
+    bool next(std::string& natural, std::string& programming)
+    {
+        while (m_index < m_end) {
+            if (m_generator.generateAt(m_index++, natural, programming)) {
+                return true;
+            }
+        }
+
+        return false;
+    };
+
+    template<typename Sink>
+    bool next(Sink& sink)
+    {
+        while (m_index < m_end) {
+            if (m_generator.generateAt(m_index++, sink)) {
+                return true;
+            }
+        }
+
+        return false;
+    };
+
+    // number of the derivation produced by the next call of next()
+    uint64_t getIndex() const
+    {
+        return m_index;
+    };
+
+    uint64_t getEnd() const
+    {
+        return m_end;
+    };
+
+    void setLevelLimit(const int64_t limit)
+    {
+        m_generator.setLevelLimit(limit);
+    };
+
+    // the number of derivations that can be enumerated, 0 if they cannot be numbered by 64 bits
+    static uint64_t getSize(const std::shared_ptr<const Grammar>& grammar)
+    {
+        if (grammar == nullptr) {
+            return 0;
+        }
+
+        const uint64_t size = grammar->getDerivations(grammar->m_root).m_count;
+        return size == DERIVATIONS_SATURATED ? 0 : size;
+    };
+
+private:
+    BasicGenerator<Engine> m_generator;
+    uint64_t m_index;
+    const uint64_t m_end;
+};
+
+
+// read-only view of a whole file
+// the file is memory-mapped, so its content is never copied
+class MappedFile
+{
+public:
+    MappedFile() = delete;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(const std::string& path)
+    {
+
+#ifdef _WIN32
+
+        m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, 
+            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+        if (m_file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+
+        LARGE_INTEGER size;
+        if (! GetFileSizeEx(m_file, &size)) {
+            return;
+        }
+
+        m_size = static_cast<size_t>(size.QuadPart);
+
+        if (m_size != 0) {
+            m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (m_mapping == nullptr) {
+                return;
+            }
+
+            m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+            if (m_data == nullptr) {
+                return;
+            }
+        }
+
+#else
+
+        const int descriptor = open(path.c_str(), O_RDONLY);
+        if (descriptor == -1) {
+            return;
+        }
+
+        struct stat info;
+        if (fstat(descriptor, &info) != 0) {
+            close(descriptor);
+            return;
+        }
+
+        m_size = static_cast<size_t>(info.st_size);
+
+        if (m_size != 0) {
+            void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+
+            if (data == MAP_FAILED) {
+                close(descriptor);
+                return;
+            }
+
+            m_data = static_cast<const char*>(data);
+        }
+
+        // the mapping stays valid after the descriptor is closed
+        close(descriptor);
+
+#endif
+
+        m_open = true;
+    };
+
+    ~MappedFile()
+    {
+
+#ifdef _WIN32
+
+        if (m_data != nullptr) {
+            UnmapViewOfFile(m_data);
+        }
+        if (m_mapping != nullptr) {
+            CloseHandle(m_mapping);
+        }
+        if (m_file != INVALID_HANDLE_VALUE) {
+            CloseHandle(m_file);
+        }
+
+#else
+
+        if (m_data != nullptr) {
+            munmap(const_cast<char*>(m_data), m_size);
+        }
+
+#endif
+
+    };
+
+    bool isOpen() const
+    {
+        return m_open;
+    };
+
+    std::string_view getContent() const
+    {
+        return m_data == nullptr 
+            ? std::string_view() 
+            : std::string_view(m_data, m_size);
+    };
+
+private:
+
+#ifdef _WIN32
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#endif
+
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_open = false;
+};
+
+
+// this section of code stores compiled grammars in cache files
+
+// size and the last modification time of a source file
+// the cache file is valid only if all source files are exactly the same as when it was written
+struct SourceStamp
+{
+    std::string m_path;
+    uint64_t m_size;
+    int64_t m_modified;
+
+    bool operator==(const SourceStamp& other) const
+    {
+        return m_path == other.m_path && m_size == other.m_size && m_modified == other.m_modified;
+    };
+};
+
+static bool getSourceStamp(const std::string& path, SourceStamp& result)
+{
+    result.m_path = path;
+
+#ifdef _WIN32
+
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (! GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data)) {
+        return false;
+    }
+
+    result.m_size = (static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+    result.m_modified = static_cast<int64_t>(
+        (static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime);
+
+#else
+
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        return false;
+    }
+
+    result.m_size = static_cast<uint64_t>(info.st_size);
+
+    // nanoseconds, so a file rewritten within the same second is noticed as well
+#ifdef __APPLE__
+    result.m_modified = static_cast<int64_t>(info.st_mtimespec.tv_sec) * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+    result.m_modified = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+
+#endif
+
+    return true;
+}
+
+
+// the cache file starts with these bytes
+static constexpr char CACHE_MAGIC[8] = { 'I', 'S', 'K', 'I', 'E', 'R', 'K', 'A' };
+
+// written in the native byte order, a cache file from a machine of different endianness is rejected
+static constexpr uint32_t CACHE_BYTE_ORDER = 0x01020304;
+
+
+// cache is written into memory first and then saved at once
+// arrays are copied byte by byte, so their elements have to be plain integers without padding
+class CacheWriter
+{
+public:
+    template<typename T>
+    void write(const T& value)
+    {
+        static_assert(std::has_unique_object_representations_v<T> || std::is_floating_point_v<T>, 
+            "cached values cannot contain padding");
+        m_data.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    };
+
+    template<typename T>
+    void writeArray(const std::vector<T>& values)
+    {
+        static_assert(std::has_unique_object_representations_v<T>, "cached values cannot contain padding");
+        write(static_cast<uint64_t>(values.size()));
+        m_data.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+    };
+
+    void writeString(const std::string& value)
+    {
+        write(static_cast<uint64_t>(value.size()));
+        m_data += value;
+    };
+
+    const std::string& getData() const
+    {
+        return m_data;
+    };
+
+private:
+    std::string m_data;
+};
+
+
+// reads values in the same order as they were written by CacheWriter
+// every read checks the remaining size, so a truncated file is only an unsuccessful read
+class CacheReader
+{
+public:
+    CacheReader() = delete;
+
+    CacheReader(const std::string_view data) : m_data(data) { };
+
+    template<typename T>
+    bool read(T& value)
+    {
+        if (m_data.size() - m_position < sizeof(T)) {
+            return false;
+        }
+
+        std::memcpy(&value, m_data.data() + m_position, sizeof(T));
+        m_position += sizeof(T);
+        return true;
+    };
+
+    template<typename T>
+    bool readArray(std::vector<T>& values)
+    {
+        uint64_t size;
+        if (! read(size) || size > (m_data.size() - m_position) / sizeof(T)) {
+            return false;
+        }
+
+        values.resize(static_cast<size_t>(size));
+        std::memcpy(values.data(), m_data.data() + m_position, values.size() * sizeof(T));
+        m_position += values.size() * sizeof(T);
+        return true;
+    };
+
+    bool readString(std::string& value)
+    {
+        uint64_t size;
+        if (! read(size) || size > m_data.size() - m_position) {
+            return false;
+        }
+
+        value.assign(m_data.data() + m_position, static_cast<size_t>(size));
+        m_position += value.size();
+        return true;
+    };
+
+    bool isFinished() const
+    {
+        return m_position == m_data.size();
+    };
+
+private:
+    const std::string_view m_data;
+    size_t m_position = 0;
+};
+
+
+// write the grammar and stamps of its source files into the cache file
+// the file is written under a temporary name and then renamed
+// so other processes loading the same codebase never see it half-written
+static bool saveCache(const std::string& path, const Grammar& grammar, const std::vector<SourceStamp>& stamps)
+{
+    CacheWriter writer;
+
+    for (const char ch : CACHE_MAGIC) {
+        writer.write(ch);
+    }
+
+    writer.write(CACHE_VERSION);
+    writer.write(CACHE_BYTE_ORDER);
+
+    writer.write(static_cast<uint64_t>(stamps.size()));
+    for (const SourceStamp& stamp : stamps) {
+        writer.writeString(stamp.m_path);
+        writer.write(stamp.m_size);
+        writer.write(stamp.m_modified);
+    }
+
+    writer.writeString(grammar.m_pool);
+    writer.writeArray(grammar.m_units);
+    writer.writeArray(grammar.m_expressions);
+    writer.writeArray(grammar.m_weights);
+    writer.writeArray(grammar.m_aliasThresholds);
+    writer.writeArray(grammar.m_aliases);
+    writer.writeArray(grammar.m_idents);
+    writer.writeArray(grammar.m_heights);
+    writer.writeArray(grammar.m_heightOrder);
+    writer.writeArray(grammar.m_heightWeights);
+    writer.writeArray(grammar.m_derivationOffsets);
+    writer.writeArray(grammar.m_expressionBounds);
+    writer.writeArray(grammar.m_choiceBounds);
+
+    // this record has padding, so its members are written one by one
+    writer.write(static_cast<uint64_t>(grammar.m_variables.size()));
+    for (const VariableRecord& record : grammar.m_variables) {
+        writer.write(record.m_expressionsBegin);
+        writer.write(record.m_expressionsEnd);
+        writer.write(record.m_totalWeight);
+        writer.write(record.m_sampling);
+    }
+
+    // estimates are doubles, which are written one by one as well
+    for (const LengthEstimate& estimate : grammar.m_lengths) {
+        writer.write(estimate.m_expectedNatural);
+        writer.write(estimate.m_expectedProgramming);
+        writer.write(estimate.m_maxNatural);
+        writer.write(estimate.m_maxProgramming);
+        writer.write(estimate.m_expectedExpressions);
+        writer.write(estimate.m_expectedUnits);
+        writer.write(estimate.m_minNatural);
+        writer.write(estimate.m_minProgramming);
+    }
+
+    for (const DerivationCount& derivations : grammar.m_derivations) {
+        writer.write(derivations.m_count);
+        writer.write(derivations.m_log2);
+    }
+
+    for (const std::string& name : grammar.m_names) {
+        writer.writeString(name);
+    }
+
+    writer.write(grammar.m_root);
+
+    std::random_device device;
+    const std::string temporaryPath = concat(path, '.', std::to_string(device()), ".tmp");
+
+    FILE* file = std::fopen(temporaryPath.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+
+    const std::string& data = writer.getData();
+    const bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+
+    if (std::fclose(file) != 0 || ! written) {
+        std::remove(temporaryPath.c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    const bool renamed = MoveFileExA(temporaryPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    const bool renamed = std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+#endif
+
+    if (! renamed) {
+        std::remove(temporaryPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+// read the grammar from the cache file
+// returns nullptr if there is no cache file, it is damaged, or it was written for different source files
+static std::shared_ptr<const Grammar> loadCache(const std::string& path, const std::vector<SourceStamp>& stamps)
+{
+    const MappedFile file(path);
+
+    if (! file.isOpen()) {
+        return nullptr;
+    }
+
+    CacheReader reader(file.getContent());
+
+    for (const char ch : CACHE_MAGIC) {
+        char value;
+        if (! reader.read(value) || value != ch) {
+            return nullptr;
+        }
+    }
+
+    uint32_t version;
+    uint32_t byteOrder;
+
+    if (! reader.read(version) || version != CACHE_VERSION
+        || ! reader.read(byteOrder) || byteOrder != CACHE_BYTE_ORDER)
+    {
+        return nullptr;
+    }
+
+    uint64_t stampCount;
+    if (! reader.read(stampCount) || stampCount != stamps.size()) {
+        return nullptr;
+    }
+
+    for (const SourceStamp& expected : stamps) {
+        SourceStamp stamp;
+
+        if (! reader.readString(stamp.m_path) || ! reader.read(stamp.m_size) 
+            || ! reader.read(stamp.m_modified) || ! (stamp == expected)) 
+        {
+            return nullptr;
+        }
+    }
+
+    std::shared_ptr<Grammar> grammar = std::make_shared<Grammar>();
+
+    if (! reader.readString(grammar->m_pool)
+        || ! reader.readArray(grammar->m_units)
+        || ! reader.readArray(grammar->m_expressions)
+        || ! reader.readArray(grammar->m_weights)
+        || ! reader.readArray(grammar->m_aliasThresholds)
+        || ! reader.readArray(grammar->m_aliases)
+        || ! reader.readArray(grammar->m_idents)
+        || ! reader.readArray(grammar->m_heights)
+        || ! reader.readArray(grammar->m_heightOrder)
+        || ! reader.readArray(grammar->m_heightWeights)
+        || ! reader.readArray(grammar->m_derivationOffsets)
+        || ! reader.readArray(grammar->m_expressionBounds)
+        || ! reader.readArray(grammar->m_choiceBounds))
+    {
+        return nullptr;
+    }
+
+    uint64_t variableCount;
+    if (! reader.read(variableCount) || variableCount > UINT32_MAX) {
+        return nullptr;
+    }
+
+    for (uint64_t i = 0; i < variableCount; i++) {
+        VariableRecord record;
+
+        if (! reader.read(record.m_expressionsBegin) || ! reader.read(record.m_expressionsEnd)
+            || ! reader.read(record.m_totalWeight) || ! reader.read(record.m_sampling))
+        {
+            return nullptr;
+        }
+
+        grammar->m_variables.push_back(record);
+    }
+
+    for (uint64_t i = 0; i < variableCount; i++) {
+        LengthEstimate estimate;
+
+        if (! reader.read(estimate.m_expectedNatural) || ! reader.read(estimate.m_expectedProgramming)
+            || ! reader.read(estimate.m_maxNatural) || ! reader.read(estimate.m_maxProgramming)
+            || ! reader.read(estimate.m_expectedExpressions) || ! reader.read(estimate.m_expectedUnits)
+            || ! reader.read(estimate.m_minNatural) || ! reader.read(estimate.m_minProgramming))
+        {
+            return nullptr;
+        }
+
+        grammar->m_lengths.push_back(estimate);
+    }
+
+    for (uint64_t i = 0; i < variableCount; i++) {
+        DerivationCount derivations;
+
+        if (! reader.read(derivations.m_count) || ! reader.read(derivations.m_log2)) {
+            return nullptr;
+        }
+
+        grammar->m_derivations.push_back(derivations);
+    }
+
+    grammar->m_names.resize(static_cast<size_t>(variableCount));
+
+    for (std::string& name : grammar->m_names) {
+        if (! reader.readString(name)) {
+            return nullptr;
+        }
+    }
+
+    if (! reader.read(grammar->m_root) || ! reader.isFinished() || ! grammar->isConsistent()) {
+        return nullptr;
+    }
+
+    return grammar;
+}
+
+
 // we parse lines using a state machine
 enum LineParsingMode
 {
@@ -288,234 +5196,339 @@ static bool directoryExists(const std::string& path)
 }
 
 
-class IskierkaGen
+// hash expression parsed from some source file
+// it is inserted into its variable only when all files are parsed
+struct PendingExpression
 {
-public:
-    IskierkaGen() = delete;
+    uint32_t m_variable;
+    int64_t m_weight;
+    int64_t m_line;
+    units_t m_natural;
+    units_t m_programming;
+    ArenaSpan<const uint32_t> m_uniqueIdents;
+};
 
-    // path = relative path to the directory with *.iski files (NO recursive traversation)
-    // flags = execution flags
-    IskierkaGen(const std::string& path, const uint32_t flags) 
-        : m_flags(flags), m_randomness(m_randomDevice())
-    {
-        loadData(path);
-    };
 
-    // path = relative path to the directory with *.iski files (NO recursive traversation)
-    IskierkaGen(const std::string& path) 
-        : m_flags(ISKIERKA_FLAG_NONE), m_randomness(m_randomDevice())
+// the first reference to some variable within a source file
+struct FileReference
+{
+    uint32_t m_variable;
+    int64_t m_line;
+};
+
+
+// result of parsing one source file
+struct ParsedFile
+{
+public:
+    // remember the first error, it is printed later
+    bool fail(const std::string& msg)
     {
-        loadData(path);
+        m_error = msg;
+        return false;
     };
 
-    bool isParsed() const
+    bool fail(const std::string& msg, const std::string& filePath, const int64_t line)
     {
-        return m_isParsed;
+        return fail(concat("Iskierka error in file '", filePath, "' at line ", std::to_string(line), ": ", msg));
     };
 
-    // call this to generate a new pair of values
-    bool next(std::string& natural, std::string& programming)
-    {
-        if (! isParsed()) {
-            return false;
-        }
+    std::vector<PendingExpression> m_expressions;
+    std::vector<FileReference> m_references;
+    std::string m_error;
+    // units and string literals of hash expressions point here
+    std::unique_ptr<MappedFile> m_file;
+    ParseArena m_arena;
+};
 
-        m_level = 0;
-        natural.clear();
-        programming.clear();
 
-        return evaluateVariable(*m_rootPtr, natural, programming);
-    };
+// ids of variables already seen within one source file, the keys are views of the file
+typedef std::unordered_map<std::string_view, uint32_t, NameHasher> known_t;
 
-    uint32_t getFlags() const
-    {
-        return m_flags;
-    };
 
-    // set new recursion level limit
-    // be careful - too big will cause the program to crash in intense situations
-    // you better don't touch that
-    void setLevelLimit(const int64_t limit)
-    {
-        m_levelLimit = limit;
-    };
-    
+// loader parses Iskierka codebases and compiles them into grammars
+// every source file is read exactly once and files are parsed in parallel
+// a variable can be referenced before its hash expressions appear, then it is a placeholder until the end
+// hash expressions are merged in the order of files, so the result does not depend on the number of threads
+class CodebaseLoader
+{
+public:
+    CodebaseLoader() = delete;
 
-private:
+    // flags = execution flags
+    CodebaseLoader(const uint32_t flags) : m_flags(flags), m_threads(0) { };
+
+    // flags = execution flags
+    // threads = number of threads parsing files, 0 means all available cores
+    CodebaseLoader(const uint32_t flags, const unsigned int threads) : m_flags(flags), m_threads(threads) { };
 
     // read source files with Iskierka codes
-    void loadData(const std::string& path)
+    // returns nullptr if the codebase is not correct
+    std::shared_ptr<const Grammar> load(const std::string& path)
     {
+        m_symbols.clear();
+
         // check if the source directory exists
         if (! directoryExists(path)) {
             error(concat("Iskierka error: directory '", path, "' does not exist in this project."));
-            return;
+            return nullptr;
         }
 
         // get relative paths to all *.iski files in the source directory
         std::vector<std::string> src;
         if (! getFilesInDirectory(src, path)) {
-            return;
+            return nullptr;
         }
 
         // directory exists, but there is no file with extension *.iski
         if (src.empty()) {
             error(concat("Iskierka error: not a single *.iski file has been found in directory '", path, "'."));
-            return;
+            return nullptr;
         }
 
-        // then, do the superficial 'first pass'
-        for (const std::string& file : src) {
-            if (! firstPass(file)) {
-                return;
+        // if no source file has changed, the grammar is read straight from the cache
+        // lazy grammars view source files, which cannot be cached
+        const bool lazy = m_flags & ISKIERKA_FLAG_LAZY;
+        const bool useCache = (m_flags & ISKIERKA_FLAG_CACHE) && ! lazy;
+        const std::string cachePath = getCachePath(path);
+        std::vector<SourceStamp> stamps;
+
+        if (useCache && getSourceStamps(src, stamps)) {
+            std::shared_ptr<const Grammar> cached = loadCache(cachePath, stamps);
+            if (cached != nullptr) {
+                return cached;
+            }
+        }
+
+        // build all expressions
+        std::vector<ParsedFile> parsed(src.size());
+        parseFiles(src, parsed);
+
+        // variables are stored by their ids, all files know them by now
+        std::vector<Variable> variables(m_symbols.size());
+
+        // insert hash expressions in the order of files and lines
+        for (size_t i = 0; i < parsed.size(); i++) {
+            if (! parsed[i].m_error.empty()) {
+                error(parsed[i].m_error);
+                return nullptr;
+            }
+
+            for (PendingExpression& pe : parsed[i].m_expressions) {
+                Variable& variable = variables[pe.m_variable];
+
+                if (variable.weightIntegerOverflow(pe.m_weight)) {
+                    error("the weight of this hash expression is too big. Integer overflow happened.", src[i], pe.m_line);
+                    return nullptr;
+                }
+
+                if (! variable.insert(pe.m_natural, pe.m_programming, pe.m_uniqueIdents, pe.m_weight)) {
+                    error("we cannot add more hash expressions. The variable is sealed and finished.", src[i], pe.m_line);
+                    return nullptr;
+                }
             }
         }
 
-        // escape early if the root variable is not found
-        if (m_variables.find(ROOT) == m_variables.end()) {
+        const uint32_t root = m_symbols.find(ROOT);
+
+        if (root == NO_SYMBOL || variables[root].isEmpty()) {
             error(concat("Iskierka error: not a single instance of the variable '", ROOT, "' has been found."));
-            return;
+            return nullptr;
         }
 
-        // build all expressions
-        for (const std::string& file : src) {
-            if (! secondPass(file)) {
-                return;
+        // placeholders without any hash expression are errors
+        // they are reported at their first reference
+        for (size_t i = 0; i < parsed.size(); i++) {
+            for (const FileReference& ref : parsed[i].m_references) {
+                if (variables[ref.m_variable].isEmpty()) {
+                    error(concat("variable '", m_symbols.getName(ref.m_variable), "' has not been defined."), src[i], ref.m_line);
+                    return nullptr;
+                }
             }
         }
 
-        // check a very rare error if files were mutated during parsing
-        for (auto& v : m_variables) {
-            if (v.second.isEmpty()) {
-                error(concat("Iskierka error: variable '", v.first, "' does not have any hash expression. ",
-                    "The source code file was probably mutated by an external program during parsing. Try to run again."
-                ));
-                return;
+        // seal variables => prepare probability distributions for them
+        for (Variable& v : variables) {
+            v.seal();
+        }
+
+        // compile variables into flat arrays, then the parsed structures are no longer needed
+        std::shared_ptr<Grammar> grammar = std::make_shared<Grammar>();
+
+        if (! grammar->compile(variables, m_symbols, root, lazy)) {
+            error("Iskierka error: the codebase is too big. We are restricted by 32-bit indices.");
+            return nullptr;
+        }
+
+        // lazy hash expressions point into source files, so they stay mapped
+        if (! grammar->m_lazyExpressions.empty()) {
+            for (ParsedFile& file : parsed) {
+                grammar->m_sources.emplace_back(std::move(file.m_file));
             }
         }
 
-        // seal variables => prepare probability distributions for them
-        for (auto& v : m_variables) {
-            v.second.seal();
+        variables.clear();
+        m_symbols.clear();
+        grammar->optimize();
+
+        // the codebase is correct even if the cache cannot be written
+        if (useCache && stamps.size() == src.size() && ! saveCache(cachePath, *grammar, stamps)) {
+            error(concat("Iskierka error: unable to write cache file '", cachePath, "'."));
         }
-       
-        // if everything is fine, set value m_isParsed and load m_rootPtr for future fast access
-        m_rootPtr = &m_variables.find(ROOT)->second;
-        m_isParsed = true;
+
+        return grammar;
+    };
+
+private:
+
+    void error(const std::string& msg)
+    {
+        if (m_flags & ISKIERKA_FLAG_SHOW_NO_ERRORS) {
+            return;
+        }
+
+        std::cout << msg << std::endl;
     };
 
-    bool evaluateVariable(Variable& var, std::string& natural, std::string& programming)
+    void error(const std::string& msg, const std::string& filePath, const int64_t line)
     {
-        const HashExpression& expr = var.getRandomHashExpression(m_randomness);
-        return evaluateHashExpression(expr, natural, programming);
+        if (m_flags & ISKIERKA_FLAG_SHOW_NO_ERRORS) {
+            return;
+        }
+
+        std::cout << concat("Iskierka error in file '", filePath, "' at line ", std::to_string(line), ": ", msg) << std::endl;
     };
 
-    bool evaluateHashExpression(const HashExpression& expr, std::string& natural, std::string& programming)
+    static std::string getCachePath(const std::string& path)
     {
-        std::unordered_map<Variable*, std::string> naturals;
-        std::unordered_map<Variable*, std::string> programmings;
-        
-        for (Variable* var : expr.m_uniqueIdents) {
-            std::string n;
-            std::string p;
 
-            m_level++;
+#ifdef _WIN32
+        return concat(path, '\\', CACHE_FILE);
+#else
+        return concat(path, '/', CACHE_FILE);
+#endif
+
+    };
+
+    // stamps of all source files, in the same order as the files
+    bool getSourceStamps(const std::vector<std::string>& src, std::vector<SourceStamp>& stamps) const
+    {
+        stamps.resize(src.size());
 
-            if (m_level >= m_levelLimit || ! evaluateVariable(*var, n, p)) {
+        for (size_t i = 0; i < src.size(); i++) {
+            if (! getSourceStamp(src[i], stamps[i])) {
+                stamps.clear();
                 return false;
             }
-
-            m_level--;
-            
-            naturals.emplace(var, n);
-            programmings.emplace(var, p);
         }
 
-        bool naturalOmitSpace = false;
-        bool programmingOmitSpace = false;
+        return true;
+    };
 
-        for (const std::unique_ptr<Unit>& he : expr.m_natural) {
-            if (he->getVariablePtr() == nullptr) {
-                if (naturalOmitSpace) {
-                    naturalOmitSpace = false;
+    // find all *.iski files in the source directory and all its subdirectories
+    // directories are listed in parallel, which pays off on network filesystems with slow listings
+    // the order of files is sorted, so the codebase is merged in the same order on every machine
+    bool getFilesInDirectory(std::vector<std::string>& result, const std::string& path)
+    {
+        std::vector<std::string> pending = { path };
+        std::string failedDirectory;
+        size_t busy = 0;
 
-                    natural += std::isspace(he->getString()[0])
-                        ? he->getString().substr(1)
-                        : he->getString();
-                }
-                else {
-                    natural += he->getString();
+        std::mutex mutex;
+        std::condition_variable changed;
+
+        auto work = [&]() {
+            std::vector<std::string> files;
+            std::vector<std::string> subdirectories;
+            std::unique_lock<std::mutex> lock(mutex);
+
+            for (;;) {
+                // stop when there is nothing to list and nobody can find more directories
+                changed.wait(lock, [&]() { return ! pending.empty() || busy == 0; });
+
+                if (pending.empty() || ! failedDirectory.empty()) {
+                    break;
                 }
-            }
-            else {
-                naturalOmitSpace = false;
-                const std::string& add = naturals.find(he->getVariablePtr())->second;
-                if (add.empty()) {
-                    if (! natural.empty() && std::isspace(natural[natural.size() - 1])) {
-                        natural.resize(natural.size() - 1);
-                    }
-                    else {
-                        naturalOmitSpace = true;
-                    }
+
+                const std::string directory = std::move(pending.back());
+                pending.pop_back();
+                busy++;
+                lock.unlock();
+
+                files.clear();
+                subdirectories.clear();
+                const bool listed = listDirectory(directory, files, subdirectories);
+
+                lock.lock();
+                busy--;
+
+                if (listed) {
+                    result.insert(result.end(), files.begin(), files.end());
+                    pending.insert(pending.end(), subdirectories.begin(), subdirectories.end());
                 }
-                else {
-                    natural += add;
+                else if (failedDirectory.empty()) {
+                    failedDirectory = directory;
+                    pending.clear();
                 }
+
+                changed.notify_all();
             }
+        };
+
+        const unsigned int threads = m_threads == 0 
+            ? std::max(std::thread::hardware_concurrency(), 1u)
+            : m_threads;
+
+        // the calling thread works as well
+        std::vector<std::thread> workers;
+        for (unsigned int i = 1; i < threads; i++) {
+            workers.emplace_back(work);
         }
 
-        for (const std::unique_ptr<Unit>& he : expr.m_programming) {
-            if (he->getVariablePtr() == nullptr) {
-                if (programmingOmitSpace) {
-                    programmingOmitSpace = false;
+        work();
 
-                    programming += std::isspace(he->getString()[0])
-                        ? he->getString().substr(1)
-                        : he->getString();
-                }
-                else {
-                    programming += he->getString();
-                }
-            }
-            else {
-                programmingOmitSpace = false;
-                const std::string& add = programmings.find(he->getVariablePtr())->second;
-                if (add.empty()) {
-                    if (! programming.empty() && std::isspace(programming[programming.size() - 1])) {
-                        programming.resize(programming.size() - 1);
-                    }
-                    else {
-                        programmingOmitSpace = true;
-                    }
-                }
-                else {
-                    programming += add;
-                }
-            }
+        for (std::thread& w : workers) {
+            w.join();
         }
 
+        if (! failedDirectory.empty()) {
+            error(concat("Iskierka error: source directory '", failedDirectory, "' could not be opened."));
+            return false;
+        }
+
+        std::sort(result.begin(), result.end());
         return true;
     };
 
-    void error(const std::string& msg)
+    static bool hasSourceExtension(const std::string& filename)
     {
-        if (m_flags & ISKIERKA_FLAG_SHOW_NO_ERRORS) {
-            return;
+        const size_t length = std::strlen(EXTENSION) + 1;
+
+        if (filename.size() < length || filename[filename.size() - length] != '.') {
+            return false;
         }
 
-        std::cout << msg << std::endl;
-    };
+        for (size_t i = 1; i < length; i++) {
+            const char ch = filename[filename.size() - length + i];
+
+#ifdef _WIN32
+            // file names are not case-sensitive on Windows
+            if (std::tolower(static_cast<unsigned char>(ch)) != EXTENSION[i - 1]) {
+                return false;
+            }
+#else
+            if (ch != EXTENSION[i - 1]) {
+                return false;
+            }
+#endif
 
-    void error(const std::string& msg, const std::string& filePath, const int64_t line)
-    {
-        if (m_flags & ISKIERKA_FLAG_SHOW_NO_ERRORS) {
-            return;
         }
 
-        std::cout << concat("Iskierka error in file '", filePath, "' at line ", std::to_string(line), ": ", msg) << std::endl;
+        return true;
     };
 
-    bool getFilesInDirectory(std::vector<std::string>& result, const std::string& path)
+    // source files and subdirectories of one directory
+    static bool listDirectory(const std::string& path, std::vector<std::string>& files, std::vector<std::string>& subdirectories)
     {
 
 #ifdef _WIN32
@@ -523,17 +5536,28 @@ private:
         WIN32_FIND_DATAA findFileData;
         HANDLE hFind;
 
-        const std::string searchPattern = concat(path, "\\*.", EXTENSION);
+        const std::string searchPattern = concat(path, "\\*");
 
         hFind = FindFirstFileA(searchPattern.c_str(), &findFileData);
         if (hFind == INVALID_HANDLE_VALUE) {
-            error(concat("Iskierka error: not a single *.iski file has been found in directory '", path, "'."));
             return false;
         }
 
         do {
-            if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
-                result.emplace_back(concat(path, '\\', findFileData.cFileName));
+            const std::string filename = findFileData.cFileName;
+
+            if (filename == "." || filename == "..") {
+                continue;
+            }
+
+            if (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                // junctions and symbolic links are not followed, they could make a cycle
+                if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+                    subdirectories.emplace_back(concat(path, '\\', filename));
+                }
+            }
+            else if (hasSourceExtension(filename)) {
+                files.emplace_back(concat(path, '\\', filename));
             }
         }
         while (FindNextFileA(hFind, &findFileData) != 0);
@@ -548,19 +5572,46 @@ private:
         dir = opendir(path.c_str());
 
         if (dir == nullptr) {
-            error(concat("Iskierka error: source directory '", path, "' could not be opened."));
             return false;
         }
 
-        const std::string extension = concat('.', EXTENSION);
-
         while ((entry = readdir(dir)) != nullptr) {
-            if (entry->d_type == DT_REG) {
-                const std::string filename = entry->d_name;
-                if (filename.size() >= extension.size() && 
-                    filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0) {
-                    result.emplace_back(concat(path, '/', filename));
+            const std::string filename = entry->d_name;
+
+            if (filename == "." || filename == "..") {
+                continue;
+            }
+
+            const std::string entryPath = concat(path, '/', filename);
+            unsigned char type = entry->d_type;
+
+            // some filesystems do not fill the type of entries
+            if (type == DT_UNKNOWN) {
+                struct stat info;
+                if (lstat(entryPath.c_str(), &info) != 0) {
+                    continue;
+                }
+
+                type = S_ISDIR(info.st_mode) ? DT_DIR 
+                    : (S_ISREG(info.st_mode) ? DT_REG 
+                    : (S_ISLNK(info.st_mode) ? DT_LNK : DT_UNKNOWN));
+            }
+
+            // symbolic links to files are read, but links to directories are not followed, they could make a cycle
+            if (type == DT_LNK) {
+                struct stat info;
+                if (stat(entryPath.c_str(), &info) != 0 || ! S_ISREG(info.st_mode)) {
+                    continue;
                 }
+
+                type = DT_REG;
+            }
+
+            if (type == DT_DIR) {
+                subdirectories.emplace_back(entryPath);
+            }
+            else if (type == DT_REG && hasSourceExtension(filename)) {
+                files.emplace_back(entryPath);
             }
         }
 
@@ -573,157 +5624,123 @@ private:
 
     bool variableAllowedStartChar(const char ch) const
     {
-        return (ch >= 'a' && ch <= 'z')
-            || (ch >= 'A' && ch <= 'Z');
+        return hasCharClass(ch, CHAR_LETTER);
     };
    
     bool variableAllowedChar(const char ch) const
     {
-        return (ch >= 'a' && ch <= 'z')
-            || (ch >= 'A' && ch <= 'Z')
-            || (ch >= '0' && ch <= '9');
+        return hasCharClass(ch, CHAR_LETTER | CHAR_DIGIT);
     };
 
     bool isLetter(const char ch) const
     {
-        return (ch >= 'a' && ch <= 'z')
-            || (ch >= 'A' && ch <= 'Z');
+        return hasCharClass(ch, CHAR_LETTER);
     };
 
-
-// the first pass scans all source files
-// and prepares a map of all used variables
-// this is the only thing we do here (besides some error checks)
-    bool firstPass(const std::string& filePath)
+    // parse every file on a pool of threads
+    // threads take files one after another by an atomic counter
+    void parseFiles(const std::vector<std::string>& src, std::vector<ParsedFile>& parsed)
     {
-        std::ifstream file(filePath);
-
-        if (!file.is_open()) {
-            error(concat("Iskierka error: unable to open file '", filePath, "'."));
-            return false;
-        }
-
-        LineParsingMode mode = LineParsingMode::FirstLine;
-        std::string line;
-        int64_t lineId = 0;
-
-        while (std::getline(file, line)) {
-            rightTrim(line);
-            lineId++;
-
-            switch (mode) {
-                case LineParsingMode::FirstLine: {
-                    if (line.empty() || line[0] != '#' || line == "##empty") {
-                        break;
-                    }
-
-                    if (line.size() == 1 && line[0] == '#') {
-                        error("missing variable name after #.", filePath, lineId);
-                        file.close();
-                        return false;
-                    }
+        unsigned int threads = m_threads == 0 
+            ? std::max(std::thread::hardware_concurrency(), 1u)
+            : m_threads;
 
-                    if (line[1] == '#') {
-                        error(concat("the double hash expression '", line, "' is not recognized."), filePath, lineId);
-                        file.close();
-                        return false;
-                    }
+        threads = static_cast<unsigned int>(std::min(static_cast<size_t>(threads), src.size()));
+        std::atomic<size_t> nextFile(0);
 
-                    size_t start = 1;
+        auto work = [&]() {
+            for (;;) {
+                const size_t i = nextFile++;
+                if (i >= src.size()) {
+                    break;
+                }
 
-                    if (! variableAllowedStartChar(line[start])) {
-                        error(concat("variable name cannot start with '", line[1], "'. Only letters a-zA-Z are allowed."), filePath, lineId);
-                        file.close();
-                        return false;
-                    }
+                parseFile(src[i], parsed[i]);
+            }
+        };
 
-                    mode = LineParsingMode::SecondLine;
+        // the calling thread works as well
+        std::vector<std::thread> workers;
+        for (unsigned int i = 1; i < threads; i++) {
+            workers.emplace_back(work);
+        }
 
-                    size_t i = start;
-                    for (; i < line.size(); i++) {
-                        if (std::isspace(line[i])) {
-                            break;
-                        }
+        work();
 
-                        if (! variableAllowedChar(line[i])) {
-                            error(concat("character '", line[i], "' is not allowed in a variable name."), filePath, lineId);
-                            file.close();
-                            return false;
-                        }
-                    }
+        for (std::thread& w : workers) {
+            w.join();
+        }
+    };
 
-                    const std::string variable = line.substr(start, i - start);
-                    m_variables.emplace(variable, Variable());
-                    break;
-                }
-                case LineParsingMode::SecondLine: {
-                    if (line.empty()) {
-                        error("second line of this hash expression is missing.", filePath, lineId);
-                        file.close();
-                        return false;
-                    }
+    // id of a variable name
+    // every file remembers ids it has already seen, so the shared table is locked once per name and file
+    uint32_t getVariable(const std::string_view name, known_t& known)
+    {
+        const auto cached = known.find(name);
+        if (cached != known.end()) {
+            return cached->second;
+        }
 
-                    mode = LineParsingMode::ThirdLine;
-                    break;
-                }
-                case LineParsingMode::ThirdLine: {
-                    if (line.empty()) {
-                        error("third line of this hash expression is missing.", filePath, lineId);
-                        file.close();
-                        return false;
-                    }
+        std::lock_guard<std::mutex> lock(m_symbolsMutex);
+        const uint32_t var = m_symbols.intern(name);
+        known.emplace(name, var);
+        return var;
+    };
 
-                    mode = LineParsingMode::FirstLine;
-                    break;
-                }
-            }
-        }
+    // a variable referenced by the code
+    uint32_t getReference(const std::string_view name, ParsedFile& result, known_t& known, const int64_t lineId)
+    {
+        const size_t size = known.size();
+        const uint32_t var = getVariable(name, known);
 
-        switch (mode) {
-            case LineParsingMode::SecondLine: {
-                error("second line of this hash expression is missing.", filePath, lineId);
-                file.close();
-                return false;
-            }
-            case LineParsingMode::ThirdLine: {
-                error("third line of this hash expression is missing.", filePath, lineId);
-                file.close();
-                return false;
-            }
-            default: {
-                break;
-            }
+        if (known.size() != size) {
+            result.m_references.push_back({ var, lineId });
         }
 
-        file.close();
-        return true;
+        return var;
     };
 
 
-// the second pass parses the code
-// and builds all the hash expressions
-    bool secondPass(const std::string& filePath)
+// parse one source file and build all its hash expressions
+// the file is memory-mapped and lines are only views of it
+// the file stays mapped in the result, so string literals do not have to be copied
+    bool parseFile(const std::string& filePath, ParsedFile& result)
     {
-        std::ifstream file(filePath);
+        result.m_file = std::make_unique<MappedFile>(filePath);
+        const MappedFile& file = *result.m_file;
 
-        if (!file.is_open()) {
-            error(concat("Iskierka error: unable to open file '", filePath, "'."));
-            return false;
+        if (! file.isOpen()) {
+            return result.fail(concat("Iskierka error: unable to open file '", filePath, "'."));
         }
 
+        known_t known;
+
+        const std::string_view content = file.getContent();
+        size_t position = 0;
+
         LineParsingMode mode = LineParsingMode::FirstLine;
-        std::string line;
         int64_t lineId = 0;
 
-        std::string variableName;
+        uint32_t variable = NO_SYMBOL;
         int64_t weight = 1;
 
         units_t natural;
         units_t programming;
 
-        while (std::getline(file, line)) {
-            rightTrim(line);
+        // units of the line being parsed, then they are copied into the arena
+        std::vector<const Unit*> units;
+        std::vector<uint32_t> uniqueIdents;
+
+        while (position < content.size()) {
+            size_t lineEnd = content.find('\n', position);
+            if (lineEnd == std::string_view::npos) {
+                lineEnd = content.size();
+            }
 
+            std::string_view line = content.substr(position, lineEnd - position);
+            position = lineEnd + 1;
+
+            rightTrim(line);
             lineId++;
 
             switch (mode) {
@@ -733,41 +5750,33 @@ private:
                     }
 
                     if (line.size() == 1 && line[0] == '#') {
-                        error("missing variable name after #.", filePath, lineId);
-                        file.close(); 
-                        return false;
+                        return result.fail("missing variable name after #.", filePath, lineId);
                     }
 
                     if (line[1] == '#') {
-                        error(concat("the double hash expression '", line,"' is not recognized."), filePath, lineId);
-                        file.close(); 
-                        return false;
+                        return result.fail(concat("the double hash expression '", std::string(line), "' is not recognized."), filePath, lineId);
                     }
                     
                     size_t start = 1;
 
                     if (! variableAllowedStartChar(line[start])) {
-                        error(concat("variable name cannot start with '", line[1], "'. Only letters a-zA-Z are allowed."), filePath, lineId);
-                        file.close(); 
-                        return false;
+                        return result.fail(concat("variable name cannot start with '", line[1], "'. Only letters a-zA-Z are allowed."), filePath, lineId);
                     }
 
                     mode = LineParsingMode::SecondLine;
 
                     size_t i = start;
                     for (; i < line.size(); i++) {
-                        if (std::isspace(line[i])) {
+                        if (isSpace(line[i])) {
                             break;
                         }
 
                         if (! variableAllowedChar(line[i])) {
-                            error(concat("character '", line[i], "' is not allowed within a variable name."), filePath, lineId);
-                            file.close(); 
-                            return false;
+                            return result.fail(concat("character '", line[i], "' is not allowed in a variable name."), filePath, lineId);
                         }
                     }
 
-                    variableName = line.substr(start, i - start);
+                    variable = getVariable(line.substr(start, i - start), known);
 
                     if (i == line.size()) {
                         weight = 1;
@@ -775,7 +5784,7 @@ private:
                     }
 
                     for (; i < line.size(); i++) {
-                        if (! std::isspace(line[i])) {
+                        if (! isSpace(line[i])) {
                             break;
                         }
                     }
@@ -783,64 +5792,57 @@ private:
                     const size_t memberStart = i;
 
                     for (; i < line.size(); i++) {
-                        if (std::isspace(line[i])) {
+                        if (isSpace(line[i])) {
                             break;
                         }
                     }
 
                     const size_t memberLen = i - memberStart;
-                    const std::string property = line.substr(memberStart, memberLen);
+                    const std::string_view property = line.substr(memberStart, memberLen);
 
                     if (property != "weight") {
-                        error(concat("'", property, "' is not a property of a hash expression."), filePath, lineId);
-                        file.close(); 
-                        return false;
+                        return result.fail(concat("'", std::string(property), "' is not a property of a hash expression."), filePath, lineId);
                     }
 
                     for (; i < line.size(); i++) {
-                        if (! std::isspace(line[i])) {
+                        if (! isSpace(line[i])) {
                             break;
                         }
                     }
 
                     if (i == line.size()) {
-                        error(concat("property '", property, "' is not followed by a positive integer argument."), 
+                        return result.fail(concat("property '", std::string(property), "' is not followed by a positive integer argument."), 
                             filePath, lineId);
-
-                        file.close(); 
-                        return false;
                     }
                     
                     const size_t integerStart = i;
                     bool wrongNumber = false;
 
                     for (; i < line.size(); i++) {
-                        if (std::isspace(line[i])) {
+                        if (isSpace(line[i])) {
                             break;
                         }
-                        else if (! std::isdigit(line[i])) {
+                        else if (! isDigit(line[i])) {
                             wrongNumber = true;
                         }
                     }
 
                     const size_t integerLen = i - integerStart;
-                    const std::string textWithNumber = line.substr(integerStart, integerLen);
+                    const std::string_view textWithNumber = line.substr(integerStart, integerLen);
 
                     if (wrongNumber) {
-                        error(concat("value '", textWithNumber, "' is not a positive integer."), filePath, lineId);
-                        file.close();
-                        return false;
+                        return result.fail(concat("value '", std::string(textWithNumber), "' is not a positive integer."), filePath, lineId);
                     }
 
-                    try {
-                        weight = std::stoll(textWithNumber);
-                    } 
-                    catch (const std::out_of_range& e) {
-                        error(concat("number '", property, "' is too big. We are restricted by the range of int64."), 
-                            filePath, lineId);
+                    weight = 0;
 
-                        file.close(); 
-                        return false;
+                    for (const char digit : textWithNumber) {
+                        if (weight > (INT64_MAX - (digit - '0')) / 10) {
+                            return result.fail(concat("number '", std::string(textWithNumber), "' is too big. We are restricted by the range of int64."), 
+                                filePath, lineId);
+                        }
+
+                        weight = weight * 10 + (digit - '0');
                     }
 
                     break;
@@ -850,18 +5852,18 @@ private:
                     leftTrim(line);
 
                     if (line.empty()) {
-                        error("second line of this hash expression is missing.", filePath, lineId);
-                        file.close(); 
-                        return false;
+                        return result.fail("second line of this hash expression is missing.", filePath, lineId);
                     }
                     
                     if (isEmptyLineIdentifier) {
-                        natural.clear();
+                        natural = units_t();
                     }
-                    else if (! parseLine(natural, line, filePath, lineId)) {
-                        file.close(); 
+                    else if (! parseLine(units, line, result, known, filePath, lineId)) {
                         return false;
                     }
+                    else {
+                        natural = units_t(result.m_arena.copy(units), units.size());
+                    }
 
                     mode = LineParsingMode::ThirdLine;
                     break;
@@ -871,32 +5873,25 @@ private:
                     leftTrim(line);
 
                     if (line.empty()) {
-                        error("third line of this hash expression is missing.", filePath, lineId);
-                        file.close(); 
-                        return false;
+                        return result.fail("third line of this hash expression is missing.", filePath, lineId);
                     }
 
                     if (isEmptyLineIdentifier) {
-                        programming.clear();
+                        programming = units_t();
                     }
-                    else if (! parseLine(programming, line, filePath, lineId)) {
-                        file.close(); 
+                    else if (! parseLine(units, line, result, known, filePath, lineId)) {
                         return false;
                     }
-
-                    Variable& id = m_variables.find(variableName)->second;
-
-                    if (id.weightIntegerOverflow(weight)) {
-                        error("the weight of this hash expression is too big. Integer overflow happened.", filePath, lineId);
-                        file.close(); 
-                        return false;
+                    else {
+                        programming = units_t(result.m_arena.copy(units), units.size());
                     }
 
-                    if (! id.insert(natural, programming, weight)) {
-                        error("we cannot add more hash expressions. The variable is sealed and finished.", filePath, lineId);
-                        file.close(); 
-                        return false;
-                    }
+                    uniqueIdents.clear();
+                    insertUniqueIdents(natural, uniqueIdents);
+                    insertUniqueIdents(programming, uniqueIdents);
+
+                    result.m_expressions.push_back({ variable, weight, lineId, natural, programming,
+                        ArenaSpan<const uint32_t>(result.m_arena.copy(uniqueIdents), uniqueIdents.size()) });
 
                     mode = LineParsingMode::FirstLine;
                     break;
@@ -906,64 +5901,58 @@ private:
 
         switch (mode) {
             case LineParsingMode::SecondLine: {
-                error("second line of this hash expression is missing.", filePath, lineId);
-                file.close(); 
-                return false;
+                return result.fail("second line of this hash expression is missing.", filePath, lineId);
             }
             case LineParsingMode::ThirdLine: {
-                error("third line of this hash expression is missing.", filePath, lineId);
-                file.close(); 
-                return false;
+                return result.fail("third line of this hash expression is missing.", filePath, lineId);
             }
             default: {
                 break;
             }
         }
 
-        file.close();
         return true;
     };
 
-    void leftTrim(std::string& value) const
+    void leftTrim(std::string_view& value) const
     {
-        for (size_t i = 0; i < value.size(); i++) {
-            if (! std::isspace(value[i])) {
-                if (i != 0) {
-                    value = value.substr(i);
-                }
-                
-                return;
-            }
+        size_t i = 0;
+        while (i < value.size() && isSpace(value[i])) {
+            i++;
         }
 
-        value.clear();
+        value.remove_prefix(i);
     };
 
-    void rightTrim(std::string& value) const
+    void rightTrim(std::string_view& value) const
     {
-        const int end = static_cast<int>(value.size()) - 1;
+        size_t i = value.size();
+        while (i > 0 && isSpace(value[i - 1])) {
+            i--;
+        }
 
-        for (int i = end; i >= 0; --i) {
-            if (! std::isspace(value[i])) {
-                if (i == end) {
-                    return;
-                }
+        value.remove_suffix(value.size() - i);
+    };
 
-                value = value.substr(0, i + 1);
-                return;
+    // variables of these units in the order of their first appearance
+    static void insertUniqueIdents(const units_t& units, std::vector<uint32_t>& uniqueIdents)
+    {
+        for (const Unit* u : units) {
+            const uint32_t var = u->getVariable();
+
+            if (var != NO_SYMBOL && std::find(uniqueIdents.begin(), uniqueIdents.end(), var) == uniqueIdents.end()) {
+                uniqueIdents.push_back(var);
             }
         }
-
-        value.clear();
     };
 
-    bool parseLine(units_t& result, const std::string& line, const std::string& filePath, const int64_t lineId)
+    bool parseLine(std::vector<const Unit*>& units, const std::string_view line, ParsedFile& result, 
+        known_t& known, const std::string& filePath, const int64_t lineId)
     {
-        result.clear();
+        units.clear();
 
         if (line.size() >= 2 && line[0] == '#' && line[1] == '#') {
-            error(concat("the double hash expression '", line, "' is not recognized."), filePath, lineId);
-            return false;
+            return result.fail(concat("the double hash expression '", std::string(line), "' is not recognized."), filePath, lineId);
         }
 
         bool nowStringLiteral = true;
@@ -971,70 +5960,493 @@ private:
 
         for (size_t i = 0; i < line.size(); i++) {
             if (nowStringLiteral) {
-                if (line[i] == PREFIX 
-                    && !(i == (line.size() - 1) || std::isspace(line[i + 1]))
+                // string literals are skipped in bulk by memchr, which is vectorized by the C library
+                i = line.find(PREFIX, i);
+                if (i == std::string_view::npos) {
+                    break;
+                }
+
+                if (!(i == (line.size() - 1) || isSpace(line[i + 1]))
                     && (i == 0 || !isLetter(line[i - 1])))
                 {
-                    const std::string literal = line.substr(start, i - start);
+                    units.push_back(result.m_arena.create<ConstUnit>(line.substr(start, i - start)));
                     start = i;
                     nowStringLiteral = false;
-                    result.emplace_back(std::make_unique<ConstUnit>(literal));
                 }
             }
             else {
                 if (! variableAllowedChar(line[i])) {
-                    const std::string name = line.substr(start + 1, i - start - 1);
+                    const std::string_view name = line.substr(start + 1, i - start - 1);
 
                     if (name.empty()) {
-                        error("variables with prefix __ are not allowed in this version of Iskierka.", filePath, lineId);
-                        return false;
-                    }
-
-                    auto var = m_variables.find(name);
-
-                    if (var == m_variables.end()) {
-                        error(concat("variable '", name, "' has not been defined."), filePath, lineId);
-                        return false;
+                        return result.fail("variables with prefix __ are not allowed in this version of Iskierka.", filePath, lineId);
                     }
 
                     start = i;
                     nowStringLiteral = line[i] != '_';
-                    result.emplace_back(std::make_unique<VariableUnit>(var->second));
+                    units.push_back(result.m_arena.create<VariableUnit>(getReference(name, result, known, lineId)));
                 }
             }
         }
 
         if (nowStringLiteral) {
-            const std::string literal = line.substr(start);
-            result.emplace_back(std::make_unique<ConstUnit>(literal));
+            units.push_back(result.m_arena.create<ConstUnit>(line.substr(start)));
         }
         else {
-            const std::string name = line.substr(start + 1);
-            auto var = m_variables.find(name);
-            if (var == m_variables.end()) {
-                error(concat("variable '", name, "' has not been defined."), filePath, lineId);
-                return false;
+            const std::string_view name = line.substr(start + 1);
+            units.push_back(result.m_arena.create<VariableUnit>(getReference(name, result, known, lineId)));
+        }
+
+        return true;
+    };
+
+    const uint32_t m_flags;
+    const unsigned int m_threads;
+    // names of all variables, shared by threads parsing files
+    SymbolTable m_symbols;
+    std::mutex m_symbolsMutex;
+};
+
+
+// number of samples taken at once by a thread of generateBatch()
+static constexpr size_t BATCH_CHUNK_SIZE = 256;
+
+// how many times generateBatch() draws a sample again if the previous draw failed
+static constexpr int64_t BATCH_ATTEMPTS = 16;
+
+
+// Engine = random number generator providing 64-bit integers
+// it has to be constructible from a 64-bit seed and support seed() for reseeding
+// for example Xoshiro256 or std::mt19937_64
+template<typename Engine>
+class BasicIskierkaGen
+{
+public:
+    BasicIskierkaGen() = delete;
+
+    // path = relative path to the directory with *.iski files (and its subdirectories)
+    // flags = execution flags
+    // seed = seed of all random values, the same seed and codebase always produce the same values
+    BasicIskierkaGen(const std::string& path, const uint32_t flags, const uint64_t seed) 
+        : m_flags(flags), m_seed(seed), m_path(path), 
+          m_source(std::make_shared<GrammarSource>(CodebaseLoader(flags).load(path))), m_generator(m_source->get(), seed, 0)
+    {
+        m_generator.setSource(m_source);
+
+        if (isParsed() && (m_flags & ISKIERKA_FLAG_STATISTICS)) {
+            m_generator.enableStatistics();
+        }
+    };
+
+    // path = relative path to the directory with *.iski files (and its subdirectories)
+    // flags = execution flags
+    BasicIskierkaGen(const std::string& path, const uint32_t flags) 
+        : BasicIskierkaGen(path, flags, randomSeed())
+    { };
+
+    // path = relative path to the directory with *.iski files (and its subdirectories)
+    BasicIskierkaGen(const std::string& path) 
+        : BasicIskierkaGen(path, ISKIERKA_FLAG_NONE, randomSeed()) 
+    { };
+
+    bool isParsed() const
+    {
+        return m_source->get() != nullptr;
+    };
+
+    // call this to generate a new pair of values
+    bool next(std::string& natural, std::string& programming)
+    {
+        if (! isParsed()) {
+            return false;
+        }
+
+        return m_generator.next(natural, programming);
+    };
+
+    // call this to generate a new pair of values directly into some sink
+    template<typename Sink>
+    bool next(Sink& sink)
+    {
+        if (! isParsed()) {
+            return false;
+        }
+
+        return m_generator.next(sink);
+    };
+
+    // generate many pairs of values in parallel
+    // output vectors are resized to n and every thread fills chunks of them with its own generator
+    // threads = number of threads, 0 means all available cores
+    // returns the number of generated pairs, failed ones are left empty
+    // every batch takes a new stream, values depend on the seed, but not on the number of threads
+    size_t generateBatch(std::vector<std::string>& naturals, std::vector<std::string>& programmings, 
+        const size_t n, unsigned int threads)
+    {
+        naturals.resize(n);
+        programmings.resize(n);
+
+        if (! isParsed()) {
+            return 0;
+        }
+
+        return runBatch(n, threads, [&](BasicGenerator<Engine>& generator, const size_t begin, const size_t end) {
+            size_t success = 0;
+
+            for (size_t i = begin; i < end; i++) {
+                if (generateSample(generator, i, naturals[i], programmings[i])) {
+                    success++;
+                }
+            }
+
+            return success;
+        });
+    };
+
+    // generate many pairs of values in parallel into the contiguous buffers of a batch
+    // the batch is cleared first, then it has n samples, failed ones are empty and invalid
+    // values are the same as those of generateBatch() with vectors of strings for the same stream
+    // every chunk is filled by a thread into its own batch and then they are copied into the result in order
+    size_t generateBatch(SampleBatch& batch, const size_t n, unsigned int threads)
+    {
+        batch.clear();
+
+        if (! isParsed()) {
+            for (size_t i = 0; i < n; i++) {
+                batch.pushSample(false);
+            }
+
+            return 0;
+        }
+
+        std::vector<SampleBatch> chunks((n + BATCH_CHUNK_SIZE - 1) / BATCH_CHUNK_SIZE);
+
+        const size_t generated = runBatch(n, threads, [&](BasicGenerator<Engine>& generator, const size_t begin, const size_t end) {
+            SampleBatch& chunk = chunks[begin / BATCH_CHUNK_SIZE];
+            ColumnWriter writer(chunk);
+            size_t success = 0;
+
+            for (size_t i = begin; i < end; i++) {
+                if (generateSample(generator, i, writer)) {
+                    success++;
+                }
+                else {
+                    chunk.pushSample(false);
+                }
             }
 
-            result.emplace_back(std::make_unique<VariableUnit>(var->second));
+            return success;
+        });
+
+        size_t naturalSize = 0;
+        size_t programmingSize = 0;
+
+        for (const SampleBatch& chunk : chunks) {
+            naturalSize += chunk.m_natural.size();
+            programmingSize += chunk.m_programming.size();
+        }
+
+        batch.m_natural.reserve(naturalSize);
+        batch.m_programming.reserve(programmingSize);
+        batch.m_naturalOffsets.reserve(n + 1);
+        batch.m_programmingOffsets.reserve(n + 1);
+        batch.m_validity.reserve((n + 7) / 8);
+
+        for (SampleBatch& chunk : chunks) {
+            batch.append(chunk);
+            chunk = SampleBatch();
+        }
+
+        return generated;
+    };
+
+    // make a new independent generator that shares the grammar with this object
+    // it can be used by another thread and it generates values of the given stream
+    // stream 0 belongs to next() of this object
+    BasicGenerator<Engine> makeGenerator(const uint64_t stream) const
+    {
+        BasicGenerator<Engine> generator(m_source->get(), m_seed, stream);
+        generator.setSource(m_source);
+        generator.setLevelLimit(m_generator.getLevelLimit());
+        generator.setDepthBudget(m_generator.getDepthBudget());
+        generator.setLengthBounds(m_generator.getLengthBounds());
+        generator.setFilter(m_generator.getFilter());
+
+        if (isParsed() && (m_flags & ISKIERKA_FLAG_STATISTICS)) {
+            generator.enableStatistics();
+        }
+
+        return generator;
+    };
+
+    // make a new independent generator with a stream that has not been used yet
+    BasicGenerator<Engine> makeGenerator()
+    {
+        return makeGenerator(m_nextStream++);
+    };
+
+    // generate the derivation number 'index' of the root, see BasicGenerator::generateAt()
+    bool generateAt(const uint64_t index, std::string& natural, std::string& programming)
+    {
+        if (! isParsed()) {
+            return false;
+        }
+
+        return m_generator.generateAt(index, natural, programming);
+    };
+
+    // make an enumerator of derivations number begin, begin + 1, ... end - 1
+    BasicEnumerator<Engine> makeEnumerator(const uint64_t begin, const uint64_t end) const
+    {
+        BasicEnumerator<Engine> enumerator(m_source->get(), begin, end);
+        enumerator.setLevelLimit(m_generator.getLevelLimit());
+        return enumerator;
+    };
+
+    // make an enumerator of all derivations of a finite codebase
+    BasicEnumerator<Engine> makeEnumerator() const
+    {
+        return makeEnumerator(0, DERIVATIONS_SATURATED);
+    };
+
+    uint64_t getSeed() const
+    {
+        return m_seed;
+    };
+
+    // the latest parsed and compiled grammar, nullptr if the codebase was not parsed
+    std::shared_ptr<const Grammar> getGrammar() const
+    {
+        return m_source->get();
+    };
+
+    // parse the codebase again in the background and swap the new grammar in when it is ready
+    // generation goes on in the meantime, next() and all generators made by makeGenerator() 
+    // take the new grammar before their next sample, the samples in progress finish on the old one
+    // if the new codebase has errors, the old grammar stays
+    // returns false if another reload is still in progress
+    bool reload()
+    {
+        if (isReloading()) {
+            return false;
         }
 
+        m_reload = std::async(std::launch::async, [this]() {
+            std::shared_ptr<const Grammar> grammar = CodebaseLoader(m_flags).load(m_path);
+            if (grammar == nullptr) {
+                return false;
+            }
+
+            m_source->publish(grammar);
+            return true;
+        });
+
         return true;
     };
 
-    const uint32_t m_flags;
-    bool m_isParsed = false;
-    std::unordered_map<std::string, Variable> m_variables;
-    Variable* m_rootPtr = nullptr;
-    std::random_device m_randomDevice;
-    std::mt19937_64 m_randomness;
+    bool isReloading() const
+    {
+        return m_reload.valid() && m_reload.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+    };
+
+    // wait for the reload in progress
+    // returns true if the new grammar has been swapped in
+    bool waitForReload()
+    {
+        return m_reload.valid() && m_reload.get();
+    };
+
+    // the shared source of the latest grammar
+    const std::shared_ptr<GrammarSource>& getSource() const
+    {
+        return m_source;
+    };
+
+    uint32_t getFlags() const
+    {
+        return m_flags;
+    };
+
+    // statistics of next() and all batches merged together
+    // they are empty unless this object was created with ISKIERKA_FLAG_STATISTICS
+    // generators made by makeGenerator() keep their own statistics, merge them with Statistics::merge()
+    // after a reload they start from zero
+    Statistics getStatistics() const
+    {
+        const std::shared_ptr<const Grammar> latest = getGrammar();
+        Statistics result = m_statisticsGrammar == latest ? m_batchStatistics : Statistics();
+
+        if (m_generator.getStatistics() != nullptr && m_generator.getGrammar() == latest) {
+            result.merge(*m_generator.getStatistics());
+        }
+
+        return result;
+    };
+
+    // n hash expressions that have been chosen most often, produced the most bytes or took the most time
+    std::vector<RuleStatistics> getHotRules(const size_t n, const StatisticsOrder order) const
+    {
+        if (! isParsed()) {
+            return std::vector<RuleStatistics>();
+        }
+
+        return getStatistics().getTopExpressions(*getGrammar(), n, order);
+    };
+
+    // set new recursion level limit
+    // evaluation uses an explicit stack, so even huge limits do not crash the program
+    // they only allow fractals to use more memory and time, see BasicGenerator::setLevelLimit()
+    void setLevelLimit(const int64_t limit)
+    {
+        m_generator.setLevelLimit(limit);
+    };
+
+    // turn on depth-bounded sampling, every sample fits into this nesting of variables
+    // 0 turns it off, see BasicGenerator::setDepthBudget()
+    void setDepthBudget(const int64_t budget)
+    {
+        m_generator.setDepthBudget(budget);
+    };
+
+    // turn on length-bounded sampling, lengths of both values of every sample are within these bounds
+    // default bounds turn it off, see BasicGenerator::setLengthBounds()
+    void setLengthBounds(const LengthBounds& bounds)
+    {
+        m_generator.setLengthBounds(bounds);
+    };
+
+    // turn on deduplication of generated pairs, nullptr turns it off
+    // the filter is shared by next(), generateBatch() and generators made afterwards by makeGenerator()
+    void setFilter(const std::shared_ptr<DedupFilter>& filter)
+    {
+        m_generator.setFilter(filter);
+    };
+
+    // the filter reports how many duplicates were drawn
+    const std::shared_ptr<DedupFilter>& getFilter() const
+    {
+        return m_generator.getFilter();
+    };
     
-    // this mechanism protects us from runtime stack overflows
-    // if too many functions are called recursively
-    // the next() function is forced to fail instead of causing program crash
-    // you can turn this off and go YOLO - set m_levelLimit to some arbitrary huge value
-    int64_t m_levelLimit = DEFAULT_RECURSION_LEVEL_LIMIT;
-    int64_t m_level = 0;
+
+private:
+
+    // sample i of a batch, it is drawn again a few times if it fails
+    template<typename Output>
+    static bool generateSample(BasicGenerator<Engine>& generator, const size_t i, Output& output)
+    {
+        generator.seek(static_cast<uint64_t>(i) * BATCH_ATTEMPTS);
+
+        for (int64_t attempt = 0; attempt < BATCH_ATTEMPTS; attempt++) {
+            if (generator.next(output)) {
+                return true;
+            }
+        }
+
+        return false;
+    };
+
+    static bool generateSample(BasicGenerator<Engine>& generator, const size_t i, std::string& natural, std::string& programming)
+    {
+        generator.seek(static_cast<uint64_t>(i) * BATCH_ATTEMPTS);
+
+        for (int64_t attempt = 0; attempt < BATCH_ATTEMPTS; attempt++) {
+            if (generator.next(natural, programming)) {
+                return true;
+            }
+        }
+
+        return false;
+    };
+
+    // every thread takes chunks of samples [begin, end) with its own generator
+    // generate(generator, begin, end) fills one chunk and returns the number of generated samples
+    // every batch takes a new stream
+    template<typename Function>
+    size_t runBatch(const size_t n, unsigned int threads, Function generate)
+    {
+        if (threads == 0) {
+            threads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+
+        const uint64_t stream = m_nextStream++;
+        std::atomic<size_t> nextChunk(0);
+        std::atomic<size_t> generated(0);
+        std::mutex statisticsMutex;
+
+        auto work = [&](BasicGenerator<Engine> generator) {
+            size_t success = 0;
+
+            for (;;) {
+                const size_t begin = nextChunk.fetch_add(BATCH_CHUNK_SIZE);
+                if (begin >= n) {
+                    break;
+                }
+
+                success += generate(generator, begin, std::min(begin + BATCH_CHUNK_SIZE, n));
+            }
+
+            generated += success;
+
+            if (generator.getStatistics() != nullptr) {
+                std::lock_guard<std::mutex> lock(statisticsMutex);
+                mergeStatistics(generator);
+            }
+        };
+
+        // the calling thread works as well
+        std::vector<std::thread> workers;
+        for (unsigned int i = 1; i < threads; i++) {
+            workers.emplace_back(work, makeGenerator(stream));
+        }
+
+        work(makeGenerator(stream));
+
+        for (std::thread& w : workers) {
+            w.join();
+        }
+
+        return generated;
+    };
+
+    // statistics refer to rules of one grammar, so only those of the latest one are kept
+    void mergeStatistics(const BasicGenerator<Engine>& generator)
+    {
+        const std::shared_ptr<const Grammar> latest = getGrammar();
+
+        if (m_statisticsGrammar != latest) {
+            m_batchStatistics = Statistics();
+            m_statisticsGrammar = latest;
+        }
+
+        if (generator.getGrammar() == latest) {
+            m_batchStatistics.merge(*generator.getStatistics());
+        }
+    };
+
+    static uint64_t randomSeed()
+    {
+        std::random_device device;
+        return (static_cast<uint64_t>(device()) << 32) ^ static_cast<uint64_t>(device());
+    };
+
+    const uint32_t m_flags;
+    const uint64_t m_seed;
+    const std::string m_path;
+    const std::shared_ptr<GrammarSource> m_source;
+    BasicGenerator<Engine> m_generator;
+    uint64_t m_nextStream = 1;
+    Statistics m_batchStatistics;
+    // the grammar m_batchStatistics refer to
+    std::shared_ptr<const Grammar> m_statisticsGrammar;
+
+    // the reload in progress, it is the last member, so its thread finishes before anything else is destroyed
+    std::future<bool> m_reload;
 };
 
+
+typedef BasicIskierkaGen<Xoshiro256> IskierkaGen;
+typedef BasicGenerator<Xoshiro256> Generator;
+typedef BasicEnumerator<Xoshiro256> Enumerator;
+
 };